@@ -25,107 +25,591 @@
 #include <ctype.h>
 #include <time.h>
 #include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "libmegahal.h"
 
+/* Replies are generated for this many seconds unless the caller gives
+ * a budget of its own. */
 #define TIMEOUT 1
 #define COOKIE "MegaHALv8"
+#define WIDE_COOKIE "MegaHALv9"
+
+/* Streamed training input is read this many bytes at a time. */
+#define READER_BUFFER (256 * 1024)
+
+/* Parallel training gives each worker a run of whole lines to learn into
+ * a private shard model.  The shards are merged into the target model in
+ * input order, which assigns every word the same symbol it would have had
+ * from learning the lines one after another. */
+#define MAX_SHARDS 64
+
+struct shard {
+	megahal_ctx_t          ctx;
+	struct megahal_model  *model;
+	const char            *data;
+	size_t                 length;
+	int                    order;
+	megahal_learn_stats_t  stats;
+	bool                   ok;
+};
 
 #define MIN(_a, _b) (((_a) < (_b)) ? (_a) :(_b))
+#define MAX(_a, _b) (((_a) > (_b)) ? (_a) :(_b))
+
+/* Text is classified and case folded through tables built from <ctype.h>
+ * the first time they are needed.  When the locale folds case only in
+ * ASCII, whole blocks of a word are folded at once with SIMD. */
+#define CHAR_ALPHA 0x01
+#define CHAR_DIGIT 0x02
+#define CHAR_SPACE 0x04
+
+/* The UTF-8 tokenizer also marks apostrophes, which join two letters, and
+ * ideographs, each of which is a word by itself.  Classes of code points
+ * below UTF8_DIRECT are looked up directly and the rest are searched for
+ * in a list of ranges. */
+#define CHAR_QUOTE 0x08
+#define CHAR_SINGLE 0x10
+#define UTF8_DIRECT 0x800
+
+struct char_table {
+	uint8_t  class[256];
+	uint8_t  upper[256];
+	uint8_t  lower[256];
+	uint8_t  utf8[UTF8_DIRECT];
+	bool     ascii;
+};
+
+struct char_range {
+	uint32_t  first;
+	uint32_t  last;
+	uint8_t   class;
+};
+
+#if defined(__AVX2__)
+#define FOLD_WIDTH 32
+#elif defined(__SSE2__)
+#define FOLD_WIDTH 16
+#endif
 
 typedef struct {
-	uint8_t  length;
-	char    *word;
+	uint32_t  length;
+	char     *word;
 } STRING;
 
+/* Dictionary words are found through an open-addressed table of symbols,
+ * keyed on a case-folded hash of the word that is kept alongside each
+ * entry so the table can be grown without rehashing any text.  Every word
+ * a dictionary keeps is already in upper case, so only the word being
+ * looked up ever needs folding. */
+#define DICT_EMPTY  UINT32_MAX
+
 struct megahal_dict {
 	uint32_t  size;
+	uint32_t  capacity;
+	uint32_t  borrowed;
 	STRING   *entry;
-	uint16_t *index;
+	uint32_t *hash;
+	uint32_t *table;
+	uint32_t  mask;
 };
 
+/* Swaps are found by a table keyed on the same case-folded hash as the
+ * dictionary, which holds the first swap from each word, kept in upper
+ * case like a dictionary's words.  The rest from
+ * the same word follow it in a chain, in the order they were added. */
 struct megahal_swaplist {
-	uint16_t  size;
-	STRING   *from;
-	STRING   *to;
+	uint16_t      size;
+	STRING       *from;
+	STRING       *to;
+	uint32_t     *hash;
+	uint16_t     *next;
+	uint16_t     *slot;
+	unsigned int  bits;
 };
 
+/* Whether each of a model's words is banned or auxiliary, by symbol.  A
+ * set is only good for the model, ban and aux dictionaries it was worked
+ * out from, and only while those dictionaries haven't grown.  As long as
+ * that holds, it is filled in for new words in place, readers seeing them
+ * once the size has been updated.  A set that has to be replaced, either
+ * to grow or because it's no longer any good, is retired rather than
+ * freed, as a reply may still be reading it.  Readers are counted while
+ * they look at a set, and the retired sets are freed by the next
+ * replacement that finds no readers. */
+#define FLAG_BANNED 0x01
+#define FLAG_AUX    0x02
+
+struct flag_set {
+	megahal_model_t   model;
+	megahal_dict_t    ban;
+	megahal_dict_t    aux;
+	uint32_t          ban_size;
+	uint32_t          aux_size;
+	uint32_t          size;
+	uint32_t          capacity;
+	struct flag_set  *retired;
+	uint8_t           flag[];
+};
+
+/* Symbols, counts and branches are all 32 bits wide, which costs nothing
+ * over the 16 bit fields MegaHALv8 stores as the node is padded out to
+ * its pointer alignment anyway.  A model whose symbols or counts no longer
+ * fit in 16 bits is "wide": it is saved as MegaHALv9, which stores every
+ * number as a varint, and frozen with 32 bit symbol and count arrays. */
 typedef struct NODE {
-	uint16_t      symbol;
+	uint32_t      symbol;
 	uint32_t      usage;
-	uint16_t      count;
-	uint16_t      branch;
-	struct NODE **tree;
+	uint32_t      count;
+	uint32_t      branch;
+	union {
+		struct NODE  *only;
+		struct NODE **tree;
+	};
 } TREE;
 
+/* How a node stores its children depends on how many it has.  A single
+ * child is held inline.  Up to FANOUT_LINEAR children are kept sorted and
+ * scanned, and up to FANOUT_HASHED sorted and binary searched.  Beyond
+ * that they are appended in insertion order and found through an open
+ * addressed index of child positions hashed on symbol, which lives after
+ * the child slots in the same allocation. */
+#define FANOUT_LINEAR  8
+#define FANOUT_HASHED  64
+
+#define SLOT_EMPTY  UINT32_MAX
+
+/* Trie nodes and their child arrays are carved out of slabs owned by the
+ * model, so allocating a node is a pointer bump and a whole trie can be
+ * released without walking it.  Child arrays always have a power-of-two
+ * number of slots; an outgrown array is kept on a per-size spare list so
+ * the next array of that size can reuse it.  Hashed arrays carry their
+ * index after the slots, so they have spare lists of their own. */
+#define POOL_ALIGN     sizeof(void *)
+#define POOL_MIN_SLAB  (16 * 1024)
+#define POOL_MAX_SLAB  (1024 * 1024)
+#define POOL_CLASSES   32
+
+struct pool_slab {
+	struct pool_slab *next;
+	size_t            size;
+	size_t            used;
+};
+
+struct node_pool {
+	struct pool_slab *slab;
+	size_t            slab_size;
+	void             *spare[POOL_CLASSES];
+	void             *hashed[POOL_CLASSES];
+};
+
+/* A frozen trie is a read-only copy of a TREE laid out breadth-first, so
+ * that the children of node n are the contiguous range of nodes from
+ * child[n] up to (but excluding) child[n + 1], sorted by symbol.  Each
+ * node also keeps the running total of its own and its earlier siblings'
+ * counts, saturating at UINT32_MAX, so that babble() can binary search
+ * for the child its random count lands on. */
+struct frozen_trie {
+	uint32_t  size;
+	bool      wide;
+	uint32_t *child;
+	uint32_t *usage;
+	uint32_t *cumulative;
+	void     *symbol;
+	void     *count;
+	void     *block;
+};
+
+/* A published snapshot carries a copy of the dictionary as it stood when
+ * it was taken, borrowing the words themselves from the model, and is
+ * freed by whoever drops the last reference to it. */
+struct snapshot {
+	struct frozen_trie   forward;
+	struct frozen_trie   backward;
+	struct megahal_dict *dictionary;
+	uint32_t             refs;
+};
+
+/* A mapped brain is a snapshot written out verbatim, so that it can be
+ * mmap'd and replied from without parsing the tries.  The header is
+ * followed by the forward and backward tries in frozen layout, the word
+ * offsets, the word hashes and finally the word text, with each trie and
+ * the words starting on an eight byte boundary.  The hashes depend on the
+ * locale's upper-casing, so they are only reused when both the saving and
+ * the loading locale upper-case as plain ASCII does. */
+#define MAPPED_COOKIE   "MegaHALm"
+#define MAPPED_VERSION  6
+#define MAPPED_ALIGN    8
+#define MAPPED_CHECKED  16
+
+struct mapped_header {
+	char     cookie[8];
+	uint32_t version;
+	uint32_t order;
+	uint32_t wide;
+	uint32_t forward;
+	uint32_t backward;
+	uint32_t words;
+	uint32_t text;
+	uint32_t ascii;
+};
+
+/* The reply path reads the tries through NODEREFs.  Without a snapshot a
+ * NODEREF is a TREE pointer; with one it is a frozen node index plus one.
+ * Either way zero means there is no node. */
+typedef uintptr_t NODEREF;
+
+#define FROZEN_REF(_n)    ((NODEREF)(_n) + 1)
+#define FROZEN_INDEX(_r)  ((uint32_t)((_r) - 1))
+
+/* Each trie is learned through its own context and node pool, so that the
+ * backward pass of a sentence can run on a worker thread while the forward
+ * pass moves on to the next one. */
+#define FORWARD   0
+#define BACKWARD  1
+
+struct learner {
+	TREE             **context;
+	struct node_pool   nodes;
+	bool               wide;
+};
+
+/* Sentences waiting for the backward worker, already resolved to symbols.
+ * Each slot keeps its symbol array from one sentence to the next. */
+#define BACKLOG_SLOTS 64
+
+struct backlog_slot {
+	uint32_t *symbol;
+	uint32_t  size;
+	uint32_t  capacity;
+};
+
+struct backlog {
+	megahal_ctx_t          ctx;
+	struct megahal_model  *model;
+	pthread_t              thread;
+	pthread_mutex_t        lock;
+	pthread_cond_t         queued;
+	pthread_cond_t         drained;
+	struct backlog_slot    slot[BACKLOG_SLOTS];
+	unsigned int           head;
+	unsigned int           tail;
+	bool                   stop;
+};
+
+/* A reply's input, kept as a copy of its words until the next learner
+ * takes the model's lock.  Once DEFERRED_LIMIT have built up, a reply that
+ * finds the model free learns them itself. */
+#define DEFERRED_LIMIT 64
+
+struct deferred {
+	struct deferred *next;
+	uint32_t         size;
+	STRING           word[];
+};
+
+/* With publishing on, replies are generated from the latest published
+ * snapshot and never wait for learning, deferring their own input to the
+ * learners instead.  Learning republishes once
+ * enough sentences or time have gone by since the last snapshot. */
+struct publisher {
+	pthread_mutex_t   lock;
+	struct snapshot  *current;
+	uint32_t          every;
+	double            interval;
+	uint32_t          pending;
+	struct timespec   last;
+	struct deferred  *deferred;
+	struct deferred **tail;
+	uint32_t          waiting;
+};
+
 struct megahal_model {
 	uint8_t      order;
 	TREE        *forward;
 	TREE        *backward;
-	TREE       **context;
+	struct learner learner[2];
+	struct backlog *backlog;
+	uint32_t    *sentence;
+	uint32_t     sentence_capacity;
 	struct megahal_dict *dictionary;
+	struct snapshot *frozen;
+	void        *map;
+	size_t       map_size;
+	bool         live;
+	bool         wide;
+	pthread_rwlock_t lock;
+	struct publisher publisher;
+};
+
+/* The keywords a reply is steered towards, resolved to symbols once so
+ * that generating never has to compare words.  Each slot of the index
+ * holds the position of the keyword whose symbol hashes there, plus one. */
+struct keyword {
+	uint32_t  symbol;
+	bool      aux;
+	bool      preferred;
+	bool      used;
+};
+
+struct keyset {
+	struct keyword *keyword;
+	uint32_t        size;
+	uint32_t        capacity;
+	uint32_t        preferred;
+	uint32_t       *slot;
+	unsigned int    bits;
+};
+
+/* Everything a reply search changes as it goes: the cursor into the tries,
+ * the keywords and whether one has been used yet, the symbols of the reply
+ * so far and the random number state.  Each search has its own, so that
+ * several can run over one model at once.  The reply starts in the middle
+ * of its buffer, growing forwards and then backwards from there.  Terms of
+ * the reply's surprise that generation already had the context for are
+ * kept as it goes: those for the forward half first, then the backward.
+ * The hashes of the replies it has already come up with are kept in a
+ * set, so that a search doesn't evaluate the same one twice. */
+struct generator {
+	megahal_personality_t     pers;
+	struct megahal_model     *model;
+	const struct snapshot    *snapshot;
+	struct megahal_dict      *dictionary;
+	const struct frozen_trie *view;
+	NODEREF                  *cursor;
+	uint32_t                  cursor_size;
+	struct keyset             keys;
+	uint32_t                 *reply;
+	uint32_t                  reply_head;
+	uint32_t                  reply_size;
+	uint32_t                  reply_capacity;
+	uint32_t                  reply_forward;
+	float                    *terms;
+	uint32_t                  terms_size;
+	uint32_t                  terms_capacity;
+	uint32_t                  forward_terms;
+	uint32_t                  scored;
+	uint64_t                 *seen;
+	uint32_t                  seen_size;
+	unsigned int              seen_bits;
+	bool                      used_key;
+	unsigned short            rng[3];
+};
+
+/* The generator and scratch dictionaries behind megahal_reply_state().
+ * They are kept between calls, so a thread that replies with the same
+ * state over and over stops allocating once the buffers have grown. */
+struct megahal_genstate {
+	struct generator     gen;
+	struct megahal_dict *words;
+	struct megahal_dict *keywords;
+	uint32_t            *input;
+	uint32_t             input_capacity;
+};
+
+/* A worker searching for replies in parallel with others, keeping the
+ * best it has found in its own output buffer. */
+#define MAX_SEARCHES 64
+
+struct search {
+	megahal_ctx_t          ctx;
+	struct generator      *gen;
+	const uint32_t        *input;
+	uint32_t               input_size;
+	const struct timespec *start;
+	double                 budget;
+	uint32_t               max_candidates;
+	uint32_t               count;
+	uint32_t               duplicates;
+	float                  surprise;
+	char                  *output;
+	size_t                 outlen;
+};
+
+/* Brains are saved through a large write buffer into a temporary file,
+ * which is renamed over the destination once it has been written out
+ * completely. */
+#define WRITER_BUFFER  (256 * 1024)
+
+struct writer {
+	int       fd;
+	char     *buffer;
+	size_t    used;
+	uint64_t  bytes;
+	bool      error;
+	char     *path;
+	char     *target;
 };
 
-static void initialize_context(struct megahal_model *);
-static void update_context(struct megahal_model *, int);
+static bool writer_open(megahal_ctx_t, struct writer *, const char *);
+static void writer_put(struct writer *, const void *, size_t);
+static bool writer_commit(megahal_ctx_t, struct writer *);
+static bool sync_directory(char *path);
+static double elapsed_seconds(const struct timespec *);
+
+static void initialize_context(struct megahal_model *, struct learner *);
+static void init_generator(struct generator *, uint64_t);
+static bool prepare_generator(megahal_ctx_t, struct generator *, megahal_personality_t, const struct snapshot *);
+static void seed_generator(struct generator *, uint64_t);
+static void free_generator(megahal_ctx_t, struct generator *);
+static bool set_keywords(megahal_ctx_t, struct generator *, struct megahal_dict *);
+static struct keyword * find_keyword(struct keyset *, uint32_t);
+static bool push_symbol(megahal_ctx_t, struct generator *, uint32_t, bool front);
+static uint64_t next_seed(void);
+static void initialize_cursor(struct generator *, bool forward);
+static void update_context(struct generator *, uint32_t);
+static int score_context(struct generator *, uint32_t, float *term);
+static bool keep_term(megahal_ctx_t, struct generator *, uint32_t);
+
+static struct snapshot * freeze_model(megahal_ctx_t, struct megahal_model *);
+static bool freeze_tree(megahal_ctx_t, TREE *, struct frozen_trie *, bool wide);
+static void free_snapshot(megahal_ctx_t, struct snapshot *);
+static struct megahal_dict * copy_dictionary(megahal_ctx_t, struct megahal_dict *);
+static bool publish_model(megahal_ctx_t, struct megahal_model *);
+static void stop_publishing(megahal_ctx_t, struct megahal_model *);
+static struct snapshot * acquire_snapshot(struct megahal_model *);
+static void release_snapshot(megahal_ctx_t, struct megahal_model *, struct snapshot *);
+static size_t frozen_bytes(uint32_t size, bool wide);
+static void layout_frozen(struct frozen_trie *, void *block, uint32_t size, bool wide);
+static bool check_frozen(const struct frozen_trie *, uint32_t words);
+static bool thaw_model(megahal_ctx_t, struct megahal_model *);
+static bool thaw_tree(megahal_ctx_t, struct node_pool *, const struct frozen_trie *, uint32_t, TREE *);
+static bool load_mapped(megahal_ctx_t, const char *, struct megahal_model *);
+static bool save_mapped(megahal_ctx_t, const char *, struct megahal_model *);
+static NODEREF find_ref(const struct frozen_trie *, NODEREF, uint32_t symbol);
+static bool ref_position(const struct frozen_trie *, NODEREF, uint32_t symbol, uint32_t *);
+static inline uint32_t ref_usage(const struct frozen_trie *, NODEREF);
+static inline uint32_t ref_count(const struct frozen_trie *, NODEREF);
 
 static struct megahal_model * new_model(megahal_ctx_t, int);
-static void update_model(megahal_ctx_t, struct megahal_model *, int);
+static void update_model(megahal_ctx_t, struct megahal_model *, struct learner *, uint32_t);
+static void learn_symbols(megahal_ctx_t, struct megahal_model *, int, const uint32_t *, uint32_t);
+static uint32_t * reserve_sentence(megahal_ctx_t, struct megahal_model *, uint32_t);
+static bool start_backlog(megahal_ctx_t, struct megahal_model *);
+static void stop_backlog(megahal_ctx_t, struct megahal_model *);
+static void sync_model(struct megahal_model *);
+static void drain_backlog(struct backlog *);
+static uint32_t * reserve_backlog(megahal_ctx_t, struct backlog *, uint32_t);
+static void commit_backlog(struct backlog *, uint32_t);
+static void * backlog_worker(void *);
 static bool load_model(megahal_ctx_t, const char *, struct megahal_model *);
 static void free_model(megahal_ctx_t, struct megahal_model *);
-static void save_model(const char *, struct megahal_model *);
+static bool save_model(megahal_ctx_t, const char *, struct megahal_model *, megahal_save_stats_t *);
 
-static void save_word(FILE *, STRING);
-static void load_word(megahal_ctx_t, FILE *, struct megahal_dict *);
+static void save_word(struct writer *, STRING, bool wide);
+static void load_word(megahal_ctx_t, FILE *, struct megahal_dict *, bool wide);
 
 static struct megahal_dict * new_dictionary(megahal_ctx_t);
 static void initialize_dictionary(megahal_ctx_t ctx, struct megahal_dict *);
-static void load_dictionary(megahal_ctx_t ctx, FILE *file, struct megahal_dict *dictionary);
-static int search_dictionary(struct megahal_dict *dictionary, STRING word, bool *find);
+static void load_dictionary(megahal_ctx_t ctx, FILE *file, struct megahal_dict *dictionary, bool wide);
+static uint32_t hash_word(STRING word);
+static bool search_dictionary(struct megahal_dict *dictionary, STRING word, uint32_t hash, uint32_t *slot);
+static uint32_t append_word(megahal_ctx_t, struct megahal_dict *dictionary, STRING word, uint32_t hash);
 static void free_dictionary(megahal_ctx_t, struct megahal_dict *);
-static void save_dictionary(FILE *file, struct megahal_dict *dictionary);
-static uint16_t find_word(struct megahal_dict *, STRING);
-static uint16_t add_word(megahal_ctx_t, struct megahal_dict *dictionary, STRING word);
-static void make_words(megahal_ctx_t ctx, char *input, struct megahal_dict *words);
+static void clear_dictionary(megahal_ctx_t, struct megahal_dict *);
+static void save_dictionary(struct writer *, struct megahal_dict *dictionary, bool wide);
+static void save_number(struct writer *, uint32_t value, size_t size, bool wide);
+static uint32_t load_number(FILE *, size_t size, bool wide);
+static uint32_t find_word(struct megahal_dict *, STRING);
+static uint32_t add_word(megahal_ctx_t, struct megahal_dict *dictionary, STRING word);
+static void make_words(megahal_ctx_t ctx, const char *input, size_t length, struct megahal_dict *words);
+static bool push_word(megahal_ctx_t ctx, struct megahal_dict *words, const char *word, size_t length);
 static void free_word(megahal_ctx_t ctx, STRING word);
 static void free_words(megahal_ctx_t ctx, struct megahal_dict *words);
-static struct megahal_dict * make_keywords(megahal_ctx_t ctx, megahal_personality_t pers, struct megahal_dict *words);
+static void make_keywords(megahal_ctx_t ctx, megahal_personality_t pers, struct megahal_dict *dictionary,
+	struct megahal_dict *words, struct megahal_dict *keys);
 
 static struct megahal_swaplist * new_swap(megahal_ctx_t);
 static void add_swap(megahal_ctx_t ctx, struct megahal_swaplist *list, const char *s, const char *d);
 static void free_swap(megahal_ctx_t ctx, struct megahal_swaplist *swap);
-
-static void load_tree(megahal_ctx_t ctx, FILE *file, TREE *node);
-static void free_tree(megahal_ctx_t ctx, TREE *);
-static void save_tree(FILE *file, TREE *node);
-static TREE * new_node(megahal_ctx_t);
-static TREE * add_symbol(megahal_ctx_t ctx, TREE *tree, uint16_t symbol);
-static TREE * find_symbol(TREE *node, int symbol);
-static TREE * find_symbol_add(megahal_ctx_t ctx, TREE *node, int symbol);
-static int search_node(TREE *node, int symbol, bool *found_symbol);
-static void add_node(megahal_ctx_t ctx, TREE *tree, TREE *node, int position);
-
-static int wordcmp(STRING word1, STRING word2);
-static void add_key(megahal_ctx_t ctx, megahal_personality_t pers, struct megahal_dict *keys, STRING word);
-static void add_aux(megahal_ctx_t ctx, megahal_personality_t pers, struct megahal_dict *keys, STRING word);
-
-static void learn(megahal_ctx_t, struct megahal_model *, struct megahal_dict *);
-static int babble(megahal_personality_t pers, struct megahal_dict *keys, struct megahal_dict *words);
-
-static void generate_reply(megahal_ctx_t ctx, megahal_personality_t pers, struct megahal_dict *words, char *, size_t);
-static void reply(megahal_ctx_t ctx, megahal_personality_t pers, struct megahal_dict *keys, struct megahal_dict *replies);
-static float evaluate_reply(struct megahal_model *model, struct megahal_dict *keys, struct megahal_dict *words);
-static void make_output(struct megahal_dict *words, char *outstr, size_t outlen);
+static uint16_t find_swap(struct megahal_swaplist *, STRING, uint32_t);
+static void insert_swap(struct megahal_swaplist *, uint16_t);
+static bool index_swaps(megahal_ctx_t, struct megahal_swaplist *, unsigned int);
+
+static void init_pool(struct node_pool *pool);
+static void * pool_alloc(megahal_ctx_t ctx, struct node_pool *pool, size_t sz);
+static void free_pool(megahal_ctx_t ctx, struct node_pool *pool);
+static void ** spare_children(struct node_pool *pool, unsigned int branch, size_t *size);
+static TREE ** new_children(megahal_ctx_t ctx, struct node_pool *pool, unsigned int branch);
+static void free_children(struct node_pool *pool, TREE **children, unsigned int branch);
+
+static void load_tree(megahal_ctx_t ctx, struct node_pool *pool, FILE *file, TREE *node, bool wide);
+static void save_tree(struct writer *, TREE *node, bool wide);
+static TREE * new_node(megahal_ctx_t, struct node_pool *pool);
+static inline TREE * node_child(const TREE *, unsigned int);
+static TREE * add_symbol(megahal_ctx_t ctx, struct node_pool *pool, TREE *tree, uint32_t symbol);
+static TREE * find_symbol(TREE *node, uint32_t symbol);
+static TREE * find_symbol_add(megahal_ctx_t ctx, struct node_pool *pool, TREE *node, uint32_t symbol);
+static int search_node(TREE *node, uint32_t symbol, bool *found_symbol);
+static TREE * find_hashed(TREE *node, uint32_t symbol);
+static uint32_t hashed_position(TREE *node, uint32_t symbol);
+static inline uint32_t hash_symbol(uint32_t, unsigned int);
+static void index_children(TREE *node);
+static void sort_children(TREE *node);
+static void add_node(megahal_ctx_t ctx, struct node_pool *pool, TREE *tree, TREE *node, int position);
+
+static bool same_word(STRING word, STRING key);
+static void add_key(megahal_ctx_t ctx, megahal_personality_t pers, struct megahal_dict *dictionary, struct megahal_dict *keys, STRING word);
+static void add_aux(megahal_ctx_t ctx, megahal_personality_t pers, struct megahal_dict *dictionary, struct megahal_dict *keys, STRING word);
+static uint8_t word_flags(megahal_ctx_t, megahal_personality_t, struct megahal_dict *, uint32_t symbol);
+static bool current_flags(megahal_personality_t, const struct flag_set *);
+static uint8_t find_flags(megahal_personality_t, STRING);
+
+static bool learn(megahal_ctx_t, struct megahal_model *, struct megahal_dict *);
+static bool learn_reply(megahal_ctx_t, struct megahal_model *, struct megahal_dict *);
+static uint32_t defer_sentence(megahal_ctx_t, struct megahal_model *, struct megahal_dict *);
+static void learn_deferred(megahal_ctx_t, struct megahal_model *);
+static void free_deferred(megahal_ctx_t, struct megahal_model *);
+static bool learn_sentence(megahal_ctx_t, struct megahal_model *, struct megahal_dict *);
+static void publish_due(megahal_ctx_t, struct megahal_model *, uint64_t);
+static size_t learn_lines(megahal_ctx_t, struct megahal_model *, struct megahal_dict *, const char *, size_t, bool, megahal_learn_stats_t *);
+static bool learn_stream(megahal_ctx_t, struct megahal_model *, FILE *, int, megahal_learn_stats_t *);
+static bool learn_parallel(megahal_ctx_t, struct megahal_model *, const char *, size_t, unsigned int, megahal_learn_stats_t *);
+static void * learn_shard(void *);
+static bool merge_model(megahal_ctx_t, struct megahal_model *, struct megahal_model *);
+static void merge_tree(megahal_ctx_t, struct megahal_model *, struct node_pool *, TREE *, TREE *, const uint32_t *);
+static void start_stats(megahal_learn_stats_t *);
+static void finish_stats(megahal_learn_stats_t *, const struct timespec *);
+static uint32_t babble(struct generator *gen);
+static bool usable_keyword(struct generator *, struct keyword *);
+static uint64_t walk_children(const struct frozen_trie *, NODEREF, uint32_t, uint32_t, int64_t, uint32_t *);
+static uint32_t search_cumulative(const uint32_t *, uint32_t, uint32_t, uint64_t);
+
+static void generate_reply(megahal_ctx_t ctx, megahal_personality_t pers, struct megahal_genstate *state,
+	const struct snapshot *, char *, size_t,
+	const megahal_reply_opts_t *, megahal_reply_stats_t *);
+static void reply(megahal_ctx_t ctx, struct generator *gen);
+static float evaluate_reply(struct generator *gen);
+static void forget_replies(struct generator *);
+static bool seen_reply(megahal_ctx_t, struct generator *);
+static void * search_replies(void *);
+static void make_output(struct generator *gen, char *outstr, size_t outlen);
 
 static void capitalize(char *string);
-static bool word_exists(struct megahal_dict *dictionary, STRING word);
-static int rnd(int range);
-static void upper(char *);
-static int seed(megahal_personality_t pers, struct megahal_dict *keys);
-static bool boundary(char *string, int position);
-static bool dissimilar(struct megahal_dict *words1, struct megahal_dict *words2);
+static uint32_t rnd(struct generator *gen, uint32_t range);
+static uint32_t seed(struct generator *gen);
+static const struct char_table * character_table(void);
+static void fold_upper(const struct char_table *, char *, const char *, size_t);
+static inline bool boundary(const unsigned char *string, const uint8_t *classes, size_t start, size_t position, size_t length);
+static void split_bytes(megahal_ctx_t, const char *, size_t, struct megahal_dict *);
+static void split_utf8(megahal_ctx_t, const char *, size_t, struct megahal_dict *);
+static uint8_t range_class(uint32_t);
+static inline uint8_t utf8_class(const struct char_table *, const unsigned char *, size_t, size_t *);
+static bool alnum_word(megahal_ctx_t, STRING);
+static bool dissimilar(const uint32_t *input, uint32_t size, struct generator *gen);
 
 struct megahal_ctx {
 	megahal_alloc_funcs_t *af;
+	megahal_tokenizer_t    tokenizer;
 };
 
 struct megahal_personality {
@@ -133,7 +617,9 @@ struct megahal_personality {
 	megahal_dict_t     ban;
 	megahal_dict_t     aux;
 	megahal_swaplist_t swap;
-	bool               used_key;
+	struct flag_set   *flags;
+	uint32_t           flags_readers;
+	pthread_mutex_t    flags_lock;
 };
 
 static void *
@@ -198,6 +684,7 @@ int
 megahal_ctx_init(megahal_ctx_t *ctx_out, megahal_alloc_funcs_t *af)
 {
 	srand48(time(NULL));
+	character_table();
 
 	if (!af) {
 		af = &default_alloc_funcs;
@@ -211,12 +698,25 @@ megahal_ctx_init(megahal_ctx_t *ctx_out, megahal_alloc_funcs_t *af)
 	}
 
 	ctx->af = af;
+	ctx->tokenizer = MEGAHAL_TOKENIZER_BYTES;
 
 	*ctx_out = ctx;
 
 	return 0;
 }
 
+int
+megahal_ctx_set_tokenizer(megahal_ctx_t ctx, megahal_tokenizer_t tokenizer)
+{
+	if ((tokenizer != MEGAHAL_TOKENIZER_BYTES) && (tokenizer != MEGAHAL_TOKENIZER_UTF8)) {
+		return -1;
+	}
+
+	ctx->tokenizer = tokenizer;
+
+	return 0;
+}
+
 int
 megahal_personality_init(megahal_ctx_t ctx, megahal_personality_t *pers_out)
 {
@@ -230,12 +730,38 @@ megahal_personality_init(megahal_ctx_t ctx, megahal_personality_t *pers_out)
 	pers->aux = NULL;
 	pers->swap = NULL;
 	pers->model = NULL;
+	pers->flags = NULL;
+	pers->flags_readers = 0;
+	pthread_mutex_init(&pers->flags_lock, NULL);
 
 	*pers_out = pers;
 
 	return 0;
 }
 
+/* The model, dictionaries and swap list a personality uses are the
+ * caller's, and aren't freed with it. */
+int
+megahal_personality_free(megahal_ctx_t ctx, megahal_personality_t pers)
+{
+	struct flag_set *set;
+	struct flag_set *retired;
+
+	if (!ctx || !pers) {
+		return -1;
+	}
+
+	for (set = pers->flags; set != NULL; set = retired) {
+		retired = set->retired;
+		af_free(ctx, set);
+	}
+
+	pthread_mutex_destroy(&pers->flags_lock);
+	af_free(ctx, pers);
+
+	return 0;
+}
+
 int
 megahal_personality_set_model(megahal_personality_t pers, megahal_model_t model)
 {
@@ -305,6 +831,163 @@ megahal_model_init(megahal_ctx_t ctx, megahal_model_t *model_out)
 	return 0;
 }
 
+int
+megahal_model_free(megahal_ctx_t ctx, megahal_model_t model)
+{
+	if (!ctx || !model) {
+		return -1;
+	}
+
+	free_model(ctx, model);
+
+	return 0;
+}
+
+int
+megahal_model_freeze(megahal_ctx_t ctx, megahal_model_t model)
+{
+	struct snapshot *snapshot;
+
+	if (!ctx || !model) {
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&model->lock);
+	learn_deferred(ctx, model);
+
+	/* A mapped model that hasn't been changed is its own snapshot. */
+	if (!model->live) {
+		pthread_rwlock_unlock(&model->lock);
+		return 0;
+	}
+
+	snapshot = freeze_model(ctx, model);
+
+	if (!snapshot) {
+		pthread_rwlock_unlock(&model->lock);
+		return -1;
+	}
+
+	free_snapshot(ctx, model->frozen);
+	model->frozen = snapshot;
+	pthread_rwlock_unlock(&model->lock);
+
+	return 0;
+}
+
+/* Models widen by themselves once a symbol or count outgrows 16 bits or
+ * a word outgrows 255 bytes; this lets a caller opt in to the wide format
+ * ahead of time. */
+int
+megahal_model_widen(megahal_ctx_t ctx, megahal_model_t model)
+{
+	if (!ctx || !model) {
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&model->lock);
+	model->wide = true;
+	pthread_rwlock_unlock(&model->lock);
+
+	return 0;
+}
+
+/* In concurrent mode learning hands the backward pass of each sentence to
+ * a worker thread.  Anything that reads the backward trie waits for the
+ * worker first. */
+int
+megahal_model_set_concurrent(megahal_ctx_t ctx, megahal_model_t model, int concurrent)
+{
+	bool ok = true;
+
+	if (!ctx || !model) {
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&model->lock);
+
+	if (!concurrent) {
+		stop_backlog(ctx, model);
+	} else {
+		ok = start_backlog(ctx, model);
+	}
+
+	pthread_rwlock_unlock(&model->lock);
+
+	return ok ? 0 : -1;
+}
+
+/* Publishing makes replies run against a snapshot of the model, so that
+ * they neither wait for learning nor see half of a sentence.  Learning
+ * publishes a fresh snapshot every so many sentences or microseconds,
+ * whichever comes first; each one is a full freeze of the model, so the
+ * limits trade reply freshness against the cost of freezing.  Passing
+ * no options turns publishing off. */
+int
+megahal_model_set_publishing(megahal_ctx_t ctx, megahal_model_t model, const megahal_publish_opts_t *opts)
+{
+	bool ok = true;
+
+	if (!ctx || !model) {
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&model->lock);
+
+	if (opts == NULL) {
+		stop_publishing(ctx, model);
+	} else {
+		model->publisher.every = opts->every_sentences;
+		model->publisher.interval = (double)opts->interval_us / 1e6;
+		ok = publish_model(ctx, model);
+	}
+
+	pthread_rwlock_unlock(&model->lock);
+
+	return ok ? 0 : -1;
+}
+
+int
+megahal_model_publish(megahal_ctx_t ctx, megahal_model_t model)
+{
+	bool ok = false;
+
+	if (!ctx || !model) {
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&model->lock);
+
+	if (model->publisher.current != NULL) {
+		ok = publish_model(ctx, model);
+	}
+
+	pthread_rwlock_unlock(&model->lock);
+
+	return ok ? 0 : -1;
+}
+
+int
+megahal_model_unfreeze(megahal_ctx_t ctx, megahal_model_t model)
+{
+	if (!ctx || !model) {
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&model->lock);
+
+	if (!thaw_model(ctx, model)) {
+		pthread_rwlock_unlock(&model->lock);
+		return -1;
+	}
+
+	free_snapshot(ctx, model->frozen);
+	model->frozen = NULL;
+	pthread_rwlock_unlock(&model->lock);
+
+	return 0;
+}
+
 int
 megahal_model_load_file(megahal_ctx_t ctx, const char *path, megahal_model_t *model_out)
 {
@@ -315,6 +998,7 @@ megahal_model_load_file(megahal_ctx_t ctx, const char *path, megahal_model_t *mo
 	}
 
 	if (load_model(ctx, path, model) == false) {
+		free_model(ctx, model);
 		return -1;
 	}
 
@@ -326,17 +1010,68 @@ megahal_model_load_file(megahal_ctx_t ctx, const char *path, megahal_model_t *mo
 int
 megahal_model_save_file(megahal_ctx_t ctx, megahal_model_t model, const char *path)
 {
-	(void)ctx;
+	return megahal_model_save_file_stats(ctx, model, path, NULL);
+}
+
+int
+megahal_model_save_file_stats(megahal_ctx_t ctx, megahal_model_t model, const char *path,
+	megahal_save_stats_t *stats)
+{
+	bool ok;
 
 	if (!model) {
 		return -1;
 	}
 
-	save_model(path, model);
+	pthread_rwlock_wrlock(&model->lock);
+	ok = thaw_model(ctx, model);
+
+	if (ok) {
+		learn_deferred(ctx, model);
+		ok = save_model(ctx, path, model, stats);
+	}
+
+	pthread_rwlock_unlock(&model->lock);
+
+	return ok ? 0 : -1;
+}
+
+int
+megahal_model_load_mapped(megahal_ctx_t ctx, const char *path, megahal_model_t *model_out)
+{
+	megahal_model_t model;
+
+	if (megahal_model_init(ctx, &model)) {
+		return -1;
+	}
+
+	if (load_mapped(ctx, path, model) == false) {
+		free_model(ctx, model);
+		return -1;
+	}
+
+	*model_out = model;
 
 	return 0;
 }
 
+int
+megahal_model_save_mapped(megahal_ctx_t ctx, megahal_model_t model, const char *path)
+{
+	bool ok;
+
+	if (!ctx || !model) {
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&model->lock);
+	learn_deferred(ctx, model);
+	ok = save_mapped(ctx, path, model);
+	pthread_rwlock_unlock(&model->lock);
+
+	return ok ? 0 : -1;
+}
+
 int
 megahal_dict_init(megahal_ctx_t ctx, megahal_dict_t *dict_out)
 {
@@ -368,8 +1103,9 @@ megahal_dict_add_word(megahal_ctx_t ctx, megahal_dict_t dict, const char *str)
 		return 0;
 	}
 
+	/* add_word() keeps its own copy of the word. */
 	word.length = strlen(str);
-	word.word = af_strdup(ctx, str);
+	word.word = (char *)str;
 	add_word(ctx, dict, word);
 
 	return 0;
@@ -409,1507 +1145,5185 @@ megahal_swaplist_add_swap(megahal_ctx_t ctx, megahal_swaplist_t swap, const char
 int
 megahal_learn(megahal_ctx_t ctx, megahal_personality_t pers, const char *str)
 {
-	// TODO: do this correctly
-	char buf[2048];
-	strncpy(buf, str, 2048);
-	buf[2047] = '\0';
+	struct megahal_dict *words;
+
+	if (!ctx || !pers || !str) {
+		return -1;
+	}
 
-	struct megahal_dict *words = new_dictionary(ctx);
+	words = new_dictionary(ctx);
+
+	if (!words) {
+		return -1;
+	}
 
-	upper(buf);
-	make_words(ctx, buf, words);
+	make_words(ctx, str, strlen(str), words);
 	learn(ctx, pers->model, words);
 
 	free_dictionary(ctx, words);
+	af_free(ctx, words);
 
 	return 0;
 }
 
 int
-megahal_reply(megahal_ctx_t ctx, megahal_personality_t pers, const char *str, char *outstr, size_t outlen)
+megahal_learn_buffer(megahal_ctx_t ctx, megahal_personality_t pers, const char *buf, size_t len, megahal_learn_stats_t *stats)
 {
-	// TODO: do this correctly
-	char buf[2048];
-	strncpy(buf, str, 2048);
-	buf[2047] = '\0';
+	struct megahal_dict *words;
+	struct timespec start;
+
+	if (!ctx || !pers || (!buf && len > 0)) {
+		return -1;
+	}
 
-	struct megahal_dict *words = new_dictionary(ctx);
+	words = new_dictionary(ctx);
 
-	upper(buf);
-	make_words(ctx, buf, words);
-	learn(ctx, pers->model, words);
-	generate_reply(ctx, pers, words, outstr, outlen);
-	capitalize(outstr);
+	if (!words) {
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	start_stats(stats);
+
+	learn_lines(ctx, pers->model, words, buf, len, true, stats);
+	finish_stats(stats, &start);
+
+	free_dictionary(ctx, words);
+	af_free(ctx, words);
 
 	return 0;
 }
 
-static struct megahal_dict *
-new_dictionary(megahal_ctx_t ctx)
+int
+megahal_learn_fd(megahal_ctx_t ctx, megahal_personality_t pers, int fd, megahal_learn_stats_t *stats)
 {
-	struct megahal_dict *dictionary = NULL;
+	if (!ctx || !pers || (fd < 0)) {
+		return -1;
+	}
 
-	dictionary = af_malloc(ctx, sizeof(*dictionary));
+	return learn_stream(ctx, pers->model, NULL, fd, stats) ? 0 : -1;
+}
 
-	if (dictionary == NULL) {
-		return NULL;
+int
+megahal_learn_file(megahal_ctx_t ctx, megahal_personality_t pers, FILE *file, megahal_learn_stats_t *stats)
+{
+	if (!ctx || !pers || !file) {
+		return -1;
 	}
 
-	dictionary->size = 0;
-	dictionary->index = NULL;
-	dictionary->entry = NULL;
+	return learn_stream(ctx, pers->model, file, -1, stats) ? 0 : -1;
+}
 
-	return dictionary;
+/* Parallel training calls the context's allocator from several threads at
+ * once, so it must be thread-safe.  A thread count of zero uses one per
+ * online CPU. */
+int
+megahal_learn_parallel(megahal_ctx_t ctx, megahal_personality_t pers, const char *buf, size_t len, unsigned int threads, megahal_learn_stats_t *stats)
+{
+	if (!ctx || !pers || (!buf && len > 0)) {
+		return -1;
+	}
+
+	return learn_parallel(ctx, pers->model, buf, len, threads, stats) ? 0 : -1;
 }
 
-static struct megahal_model *
-new_model(megahal_ctx_t ctx, int order)
+int
+megahal_learn_path_parallel(megahal_ctx_t ctx, megahal_personality_t pers, const char *path, unsigned int threads, megahal_learn_stats_t *stats)
 {
-	struct megahal_model *model = NULL;
+	struct stat st;
+	void *map;
+	bool ok;
+	int fd;
 
-	model = af_malloc(ctx, sizeof(*model));
+	if (!ctx || !pers || !path) {
+		return -1;
+	}
 
-	if (model == NULL) {
-		// TODO: Error
-		// error("new_model", "Unable to allocate model.");
-		goto fail;
+	fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		return -1;
 	}
 
-	model->order = order;
-	model->forward = new_node(ctx);
-	model->backward = new_node(ctx);
-	model->context = (TREE **)af_malloc(ctx, sizeof(TREE *) * (order + 2));
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
 
-	if (model->context == NULL) {
-		// TODO: Error
-		// error("new_model", "Unable to allocate context array.");
-		goto fail;
+	if (st.st_size == 0) {
+		close(fd);
+		return learn_parallel(ctx, pers->model, NULL, 0, threads, stats) ? 0 : -1;
 	}
 
-	initialize_context(model);
-	model->dictionary = new_dictionary(ctx);
-	initialize_dictionary(ctx, model->dictionary);
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
 
-	return model;
+	if (map == MAP_FAILED) {
+		return -1;
+	}
 
-fail:
-	return NULL;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	ok = learn_parallel(ctx, pers->model, map, st.st_size, threads, stats);
+	munmap(map, st.st_size);
+
+	return ok ? 0 : -1;
 }
 
-static void
-initialize_context(struct megahal_model *model)
+int
+megahal_reply(megahal_ctx_t ctx, megahal_personality_t pers, const char *str, char *outstr, size_t outlen)
 {
-	register unsigned int i;
-
-	for (i =0 ; i <= model->order; ++i) {
-		model->context[i] = NULL;
-	}
+	return megahal_reply_ex(ctx, pers, str, outstr, outlen, NULL, NULL);
 }
 
-static void
-update_context(struct megahal_model *model, int symbol)
+int
+megahal_reply_ex(megahal_ctx_t ctx, megahal_personality_t pers, const char *str, char *outstr, size_t outlen,
+	const megahal_reply_opts_t *opts, megahal_reply_stats_t *stats)
 {
-	register unsigned int i;
+	struct megahal_genstate *state;
+	int ret;
 
-	for (i = (model->order + 1); i > 0; --i) {
-		if (model->context[i - 1] != NULL) {
-			model->context[i] = find_symbol(model->context[i - 1], symbol);
-		}
+	if (!ctx || !pers || !str) {
+		return -1;
+	}
+
+	if (megahal_genstate_init(ctx, &state)) {
+		return -1;
 	}
+
+	ret = megahal_reply_state(ctx, pers, state, str, outstr, outlen, opts, stats);
+	megahal_genstate_free(ctx, state);
+
+	return ret;
 }
 
-void
-free_model(megahal_ctx_t ctx, struct megahal_model *model)
+/* A generation state holds everything a reply changes while it is being
+ * made.  Threads that each have their own can reply from one model, and
+ * one personality, at the same time. */
+int
+megahal_genstate_init(megahal_ctx_t ctx, megahal_genstate_t *state_out)
 {
-	if (model == NULL) {
-		return;
-	}
+	struct megahal_genstate *state;
 
-	if (model->forward != NULL) {
-		free_tree(ctx, model->forward);
+	if (!ctx) {
+		return -1;
 	}
 
-	if (model->backward != NULL) {
-		free_tree(ctx, model->backward);
-	}
+	state = af_malloc(ctx, sizeof(*state));
 
-	if (model->context != NULL) {
-		af_free(ctx, model->context);
+	if (!state) {
+		return -1;
 	}
 
-	if (model->dictionary != NULL) {
-		free_dictionary(ctx, model->dictionary);
-		af_free(ctx, model->dictionary);
+	init_generator(&state->gen, next_seed());
+	state->words = new_dictionary(ctx);
+	state->keywords = new_dictionary(ctx);
+	state->input = NULL;
+	state->input_capacity = 0;
+
+	if (!state->words || !state->keywords) {
+		megahal_genstate_free(ctx, state);
+		return -1;
 	}
 
-	af_free(ctx, model);
+	*state_out = state;
+
+	return 0;
 }
 
-static void
-learn(megahal_ctx_t ctx, struct megahal_model *model, struct megahal_dict *words)
+int
+megahal_genstate_free(megahal_ctx_t ctx, megahal_genstate_t state)
 {
-	register unsigned int i;
-	register int j;
-	uint16_t symbol;
-
-	/* We only learn from inputs which are long enough */
-	if (words->size <= (model->order)) {
-		return;
+	if (!ctx || !state) {
+		return -1;
 	}
 
-	/* Train the model in the forwards direction. Start by initializing the
-	 * context of the model. */
-	initialize_context(model);
-	model->context[0] = model->forward;
+	free_generator(ctx, &state->gen);
 
-	for (i = 0; i < words->size; ++i) {
-		/* Add the symbol to the model's dictionary if necessary, and then
-		 * update the forward model accordingly. */
-		symbol = add_word(ctx, model->dictionary, words->entry[i]);
-		update_model(ctx, model, symbol);
+	if (state->words != NULL) {
+		free_dictionary(ctx, state->words);
+		af_free(ctx, state->words);
 	}
 
-	/* Add the sentence-terminating symbol. */
-	update_model(ctx, model, 1);
-
-	/* Train the model in the backwards direction.  Start by initializing
-	 * the context of the model. */
-	initialize_context(model);
-	model->context[0] = model->backward;
+	if (state->keywords != NULL) {
+		free_words(ctx, state->keywords);
+		free_dictionary(ctx, state->keywords);
+		af_free(ctx, state->keywords);
+	}
 
-	for (j = words->size - 1; j >= 0; --j) {
-		/* Find the symbol in the model's dictionary, and then update the
-		 * backward model accordingly. */
-		symbol = find_word(model->dictionary, words->entry[j]);
-		update_model(ctx, model, symbol);
+	if (state->input != NULL) {
+		af_free(ctx, state->input);
 	}
 
-	/* Add the sentence-terminating symbol. */
-	update_model(ctx, model, 1);
+	af_free(ctx, state);
 
-	return;
+	return 0;
 }
 
-static bool
-load_model(megahal_ctx_t ctx, const char *filename, struct megahal_model *model)
+/* Seeds the state the way srand48() seeds the global sequence, so that a
+ * fixed seed gives a repeatable run of replies. */
+int
+megahal_genstate_seed(megahal_genstate_t state, uint64_t seed)
 {
-	FILE *file;
-	char cookie[16];
-
-	if (filename == NULL) {
-		return false;
+	if (!state) {
+		return -1;
 	}
 
-	file = fopen(filename, "rb");
+	seed_generator(&state->gen, seed);
 
-	if (file == NULL) {
-		// warn("load_model", "Unable to open file `%s'", filename);
-		// TODO: warn
-		return false;
-	}
+	return 0;
+}
 
-	fread(cookie, sizeof(char), strlen(COOKIE), file);
+int
+megahal_reply_state(megahal_ctx_t ctx, megahal_personality_t pers, megahal_genstate_t state, const char *str,
+	char *outstr, size_t outlen, const megahal_reply_opts_t *opts, megahal_reply_stats_t *stats)
+{
+	struct megahal_model *model;
+	struct snapshot *snapshot;
 
-	if (strncmp(cookie, COOKIE, strlen(COOKIE)) != 0) {
-		// TODO: warn
-		//warn("load_model", "File `%s' is not a MegaHAL brain", filename);
-		goto fail;
+	if (!ctx || !pers || !state || !str) {
+		return -1;
 	}
 
-	fread(&(model->order), sizeof(uint8_t), 1, file);
-	load_tree(ctx, file, model->forward);
-	load_tree(ctx, file, model->backward);
-	load_dictionary(ctx, file, model->dictionary);
+	model = pers->model;
 
-	return true;
-fail:
-	fclose(file);
+	make_words(ctx, str, strlen(str), state->words);
 
-	return false;
-}
+	snapshot = acquire_snapshot(model);
 
-static void
-update_model(megahal_ctx_t ctx, struct megahal_model *model, int symbol)
-{
-	register unsigned int i;
+	if (snapshot != NULL) {
+		learn_reply(ctx, model, state->words);
+		generate_reply(ctx, pers, state, snapshot, outstr, outlen, opts, stats);
+		release_snapshot(ctx, model, snapshot);
+	} else {
+		learn(ctx, model, state->words);
 
-	/* Update all of the models in the current context with the specified
-	 * symbol. */
-	for (i = (model->order + 1); i > 0; --i) {
-		if (model->context[i - 1] != NULL) {
-			model->context[i] = add_symbol(ctx, model->context[i - 1], (uint16_t)symbol);
-		}
+		/* Generating only reads the model, so replies share the lock
+		 * and wait just for learning, freezing and saving. */
+		pthread_rwlock_rdlock(&model->lock);
+		drain_backlog(model->backlog);
+		generate_reply(ctx, pers, state, model->frozen, outstr, outlen, opts, stats);
+		pthread_rwlock_unlock(&model->lock);
 	}
 
-	return;
+	capitalize(outstr);
+
+	return 0;
 }
 
-static uint16_t
-add_word(megahal_ctx_t ctx, struct megahal_dict *dictionary, STRING word)
+static struct megahal_dict *
+new_dictionary(megahal_ctx_t ctx)
 {
-	register int i;
-	int position;
-	bool found;
+	struct megahal_dict *dictionary = NULL;
 
-	/* If the word's already in the dictionary, there is no need to add it */
-	position = search_dictionary(dictionary, word, &found);
-	if (found == true) {
-		goto succeed;
+	dictionary = af_malloc(ctx, sizeof(*dictionary));
+
+	if (dictionary == NULL) {
+		return NULL;
 	}
 
-	/* Increase the number of words in the dictionary */
-	dictionary->size += 1;
+	dictionary->size = 0;
+	dictionary->capacity = 0;
+	dictionary->borrowed = 0;
+	dictionary->entry = NULL;
+	dictionary->hash = NULL;
+	dictionary->table = NULL;
+	dictionary->mask = 0;
 
-	/* Allocate one more entry for the word index */
-	if (dictionary->index == NULL) {
-		dictionary->index = (uint16_t *)af_malloc(ctx, sizeof(uint16_t) * (dictionary->size));
-	} else {
-		dictionary->index = (uint16_t *)af_realloc(ctx, (uint16_t *)(dictionary->index), sizeof(uint16_t) * (dictionary->size));
-	}
+	return dictionary;
+}
 
-	if (dictionary->index == NULL) {
-		// error("add_word", "Unable to reallocate the index.");
-		// TODO: Error
-		goto fail;
-	}
+static struct megahal_model *
+new_model(megahal_ctx_t ctx, int order)
+{
+	struct megahal_model *model = NULL;
 
-	/* Allocate one more entry for the word array */
-	if (dictionary->entry == NULL) {
-		dictionary->entry = (STRING *)af_malloc(ctx, sizeof(STRING) * (dictionary->size));
-	} else {
-		dictionary->entry = (STRING *)af_realloc(ctx, (STRING *)(dictionary->entry), sizeof(STRING) * (dictionary->size));
-	}
+	model = af_malloc(ctx, sizeof(*model));
 
-	if (dictionary->entry == NULL) {
-		// error("add_word", "Unable to reallocate the dictionary to %d elements.", dictionary->size);
+	if (model == NULL) {
 		// TODO: Error
+		// error("new_model", "Unable to allocate model.");
 		goto fail;
 	}
 
-	/* Copy the new word into the word array */
-	dictionary->entry[dictionary->size - 1].length = word.length;
-	dictionary->entry[dictionary->size - 1].word = (char *)af_malloc(ctx, sizeof(char) * (word.length));
-	if (dictionary->entry[dictionary->size - 1].word == NULL) {
-		// error("add_word", "Unable to allocate the word.");
+	model->order = order;
+	init_pool(&model->learner[FORWARD].nodes);
+	init_pool(&model->learner[BACKWARD].nodes);
+	model->learner[FORWARD].wide = false;
+	model->learner[BACKWARD].wide = false;
+	model->forward = new_node(ctx, &model->learner[FORWARD].nodes);
+	model->backward = new_node(ctx, &model->learner[BACKWARD].nodes);
+	model->backlog = NULL;
+	model->sentence = NULL;
+	model->sentence_capacity = 0;
+	model->frozen = NULL;
+	model->map = NULL;
+	model->map_size = 0;
+	model->live = true;
+	model->wide = false;
+	pthread_rwlock_init(&model->lock, NULL);
+	pthread_mutex_init(&model->publisher.lock, NULL);
+	model->publisher.current = NULL;
+	model->publisher.every = 0;
+	model->publisher.interval = 0.0;
+	model->publisher.pending = 0;
+	model->publisher.deferred = NULL;
+	model->publisher.tail = &model->publisher.deferred;
+	model->publisher.waiting = 0;
+	model->learner[FORWARD].context = (TREE **)af_malloc(ctx, sizeof(TREE *) * (order + 2));
+	model->learner[BACKWARD].context = (TREE **)af_malloc(ctx, sizeof(TREE *) * (order + 2));
+
+	if ((model->learner[FORWARD].context == NULL) || (model->learner[BACKWARD].context == NULL)) {
+		// TODO: Error
+		// error("new_model", "Unable to allocate context array.");
 		goto fail;
 	}
 
-	for (i = 0; i < word.length; ++i) {
-		dictionary->entry[dictionary->size - 1].word[i] = word.word[i];
-	}
-
-	/* Shuffle the word index to keep it sorted alphabetically */
-	for (i = (dictionary->size - 1); i > position; --i) {
-		dictionary->index[i] = dictionary->index[i - 1];
-	}
-
-	/* Copy the new symbol identifier into the word index */
-	dictionary->index[position] = dictionary->size - 1;
+	initialize_context(model, &model->learner[FORWARD]);
+	initialize_context(model, &model->learner[BACKWARD]);
+	model->dictionary = new_dictionary(ctx);
+	initialize_dictionary(ctx, model->dictionary);
 
-succeed:
-	return dictionary->index[position];
+	return model;
 
 fail:
-	return 0;
+	return NULL;
 }
 
 static void
-save_word(FILE *file, STRING word)
+initialize_context(struct megahal_model *model, struct learner *learner)
 {
 	register unsigned int i;
 
-	fwrite(&(word.length), sizeof(uint8_t), 1, file);
-
-	for (i = 0; i < word.length; ++i) {
-		fwrite(&(word.word[i]), sizeof(char), 1, file);
+	for (i =0 ; i <= model->order; ++i) {
+		learner->context[i] = NULL;
 	}
 }
 
-
 static void
-load_word(megahal_ctx_t ctx, FILE *file, struct megahal_dict *dictionary)
+init_generator(struct generator *gen, uint64_t seed)
 {
-	register unsigned int i;
-	STRING word;
+	gen->pers = NULL;
+	gen->model = NULL;
+	gen->snapshot = NULL;
+	gen->dictionary = NULL;
+	gen->view = NULL;
+	gen->cursor = NULL;
+	gen->cursor_size = 0;
+	gen->keys.keyword = NULL;
+	gen->keys.size = 0;
+	gen->keys.capacity = 0;
+	gen->keys.preferred = 0;
+	gen->keys.slot = NULL;
+	gen->keys.bits = 0;
+	gen->reply = NULL;
+	gen->reply_head = 0;
+	gen->reply_size = 0;
+	gen->reply_capacity = 0;
+	gen->reply_forward = 0;
+	gen->terms = NULL;
+	gen->terms_size = 0;
+	gen->terms_capacity = 0;
+	gen->forward_terms = 0;
+	gen->scored = 0;
+	gen->seen = NULL;
+	gen->seen_size = 0;
+	gen->seen_bits = 0;
+	gen->used_key = false;
+
+	seed_generator(gen, seed);
+}
 
-	fread(&(word.length), sizeof(uint8_t), 1, file);
-	word.word = (char *)af_malloc(ctx, sizeof(char) * word.length);
+/* Point the generator at a personality's model, or at a snapshot of it,
+ * growing its cursor if the model has a higher order than the last one it
+ * was used with. */
+static bool
+prepare_generator(megahal_ctx_t ctx, struct generator *gen, megahal_personality_t pers, const struct snapshot *snapshot)
+{
+	uint32_t size = pers->model->order + 2;
+	NODEREF *cursor;
+
+	gen->pers = pers;
+	gen->model = pers->model;
+	gen->snapshot = snapshot;
+	gen->dictionary = ((snapshot != NULL) && (snapshot->dictionary != NULL)) ? snapshot->dictionary : pers->model->dictionary;
+	gen->view = NULL;
+	gen->used_key = false;
+
+	if (size > gen->cursor_size) {
+		if (gen->cursor == NULL) {
+			cursor = (NODEREF *)af_malloc(ctx, sizeof(NODEREF) * size);
+		} else {
+			cursor = (NODEREF *)af_realloc(ctx, gen->cursor, sizeof(NODEREF) * size);
+		}
 
-	if (word.word == NULL) {
-		// TODO: Error
-		// error("load_word", "Unable to allocate word");
-		return;
-	}
+		if (cursor == NULL) {
+			return false;
+		}
 
-	for (i = 0; i < word.length; ++i) {
-		fread(&(word.word[i]), sizeof(char), 1, file);
+		gen->cursor = cursor;
+		gen->cursor_size = size;
 	}
 
-	add_word(ctx, dictionary, word);
-	af_free(ctx, word.word);
+	return true;
 }
 
 static void
-make_words(megahal_ctx_t ctx, char *input, struct megahal_dict *words)
+seed_generator(struct generator *gen, uint64_t seed)
 {
-	int offset = 0;
+	gen->rng[0] = 0x330e;
+	gen->rng[1] = (unsigned short)seed;
+	gen->rng[2] = (unsigned short)(seed >> 16);
+}
 
-	/* Clear the entries in the dictionary */
-	free_dictionary(ctx, words);
+static void
+free_generator(megahal_ctx_t ctx, struct generator *gen)
+{
+	if (gen->cursor != NULL) {
+		af_free(ctx, gen->cursor);
+		gen->cursor = NULL;
+	}
 
-	/* If the string is empty then do nothing, for it contains no words. */
-	if (strlen(input) == 0) {
-		return;
+	if (gen->keys.keyword != NULL) {
+		af_free(ctx, gen->keys.keyword);
+		gen->keys.keyword = NULL;
 	}
 
-	/* Loop forever. */
-	while (1) {
-		/* If the current character is of the same type as the previous
-		 * character, then include it in the word.  Otherwise, terminate
-		 * the current word. */
-		if (boundary(input, offset)) {
-			/* Add the word to the dictionary */
-			if (words->entry == NULL) {
-				words->entry = (STRING *)af_malloc(ctx, (words->size + 1) * sizeof(STRING));
-			} else {
-				words->entry = (STRING *)af_realloc(ctx, words->entry, (words->size + 1) * sizeof(STRING));
-			}
+	if (gen->keys.slot != NULL) {
+		af_free(ctx, gen->keys.slot);
+		gen->keys.slot = NULL;
+	}
 
-			if (words->entry == NULL) {
-				// TODO: Error
-				// error("make_words", "Unable to reallocate dictionary");
-				return;
-			}
+	if (gen->reply != NULL) {
+		af_free(ctx, gen->reply);
+		gen->reply = NULL;
+	}
+
+	if (gen->terms != NULL) {
+		af_free(ctx, gen->terms);
+		gen->terms = NULL;
+	}
 
-			words->entry[words->size].length = offset;
-			words->entry[words->size].word = input;
-			words->size += 1;
+	if (gen->seen != NULL) {
+		af_free(ctx, gen->seen);
+		gen->seen = NULL;
+	}
 
-			if (offset == (int)strlen(input)) {
-				break;
-			}
+	gen->cursor_size = 0;
+	gen->keys.size = 0;
+	gen->keys.capacity = 0;
+	gen->keys.preferred = 0;
+	gen->reply_head = 0;
+	gen->reply_size = 0;
+	gen->reply_capacity = 0;
+}
+
+/* Resolve the keywords to symbols in the generator's dictionary, along
+ * with whether each is an auxilliary keyword. */
+static bool
+set_keywords(megahal_ctx_t ctx, struct generator *gen, struct megahal_dict *keys)
+{
+	struct keyset *set = &gen->keys;
+	struct keyword *keyword;
+	register uint32_t i;
+	uint32_t size = (keys == NULL) ? 0 : keys->size;
+	unsigned int bits = 3;
+	uint32_t mask;
+	uint32_t h;
+	void *grown;
+
+	set->size = 0;
+	set->preferred = 0;
+
+	if (size > set->capacity) {
+		while ((1u << bits) < (2 * size)) {
+			++bits;
+		}
 
-			input += offset;
-			offset = 0;
+		if (set->keyword == NULL) {
+			grown = af_malloc(ctx, sizeof(struct keyword) * size);
 		} else {
-			++offset;
+			grown = af_realloc(ctx, set->keyword, sizeof(struct keyword) * size);
 		}
-	}
 
-	/* If the last word isn't punctuation, then replace it with a full-stop
-	 * character. */
-	if (isalnum(words->entry[words->size-1].word[0])) {
-		if (words->entry == NULL) {
-			words->entry = (STRING *)af_malloc(ctx, (words->size + 1) * sizeof(STRING));
+		if (grown == NULL) {
+			return false;
+		}
+
+		set->keyword = (struct keyword *)grown;
+
+		if (set->slot == NULL) {
+			grown = af_malloc(ctx, sizeof(uint32_t) << bits);
 		} else {
-			words->entry = (STRING *)af_realloc(ctx, words->entry, (words->size + 1) * sizeof(STRING));
+			grown = af_realloc(ctx, set->slot, sizeof(uint32_t) << bits);
 		}
 
-		if (words->entry == NULL) {
-			// error("make_words", "Unable to reallocate dictionary");
-			// TODO: Error
-			return;
+		if (grown == NULL) {
+			return false;
 		}
 
-		words->entry[words->size].length = 1;
-		words->entry[words->size].word = ".";
-		++words->size;
-	} else if (strchr("!.?", words->entry[words->size - 1].word[words->entry[words->size - 1].length - 1]) == NULL) {
-		words->entry[words->size - 1].length = 1;
-		words->entry[words->size - 1].word = ".";
+		set->slot = (uint32_t *)grown;
+		set->bits = bits;
+		set->capacity = size;
 	}
 
-	return;
-}
+	if (set->slot == NULL) {
+		return true;
+	}
 
-static uint16_t
-find_word(struct megahal_dict *dictionary, STRING word)
-{
-	int position;
-	bool found;
+	mask = (1u << set->bits) - 1;
 
-	if (!dictionary) {
-		return 0;
+	for (i = 0; i <= mask; ++i) {
+		set->slot[i] = 0;
 	}
 
-	position = search_dictionary(dictionary, word, &found);
+	for (i = 0; i < size; ++i) {
+		keyword = &set->keyword[i];
+		keyword->symbol = find_word(gen->dictionary, keys->entry[i]);
 
-	if (found == true) {
-		return dictionary->index[position];
-	} else {
-		return 0;
+		if (keyword->symbol != 0) {
+			keyword->aux = ((word_flags(ctx, gen->pers, gen->dictionary, keyword->symbol) & FLAG_AUX) != 0);
+		} else {
+			keyword->aux = (find_word(gen->pers->aux, keys->entry[i]) != 0);
+		}
+		keyword->used = false;
+
+		/* find_word() can't tell the first keyword from a missing one,
+		 * so it has never been preferred while babbling or counted when
+		 * evaluating a reply.  Keep it that way. */
+		keyword->preferred = (i > 0);
+		set->preferred += keyword->preferred;
+
+		if (keyword->symbol == 0) {
+			continue;
+		}
+
+		for (h = hash_symbol(keyword->symbol, set->bits); set->slot[h] != 0; h = (h + 1) & mask) {
+			;
+		}
+
+		set->slot[h] = i + 1;
 	}
-}
 
-static void
-free_word(megahal_ctx_t ctx, STRING word)
-{
-	af_free(ctx, word.word);
+	set->size = size;
+
+	return true;
 }
 
-static void
-free_words(megahal_ctx_t ctx, struct megahal_dict *words)
+static struct keyword *
+find_keyword(struct keyset *set, uint32_t symbol)
 {
-	register unsigned int i;
+	uint32_t mask;
+	uint32_t h;
 
-	if (words == NULL) {
-		return;
+	if (set->size == 0) {
+		return NULL;
 	}
 
-	if (words->entry != NULL) {
-		for (i = 0; i < words->size; ++i) {
-			free_word(ctx, words->entry[i]);
+	mask = (1u << set->bits) - 1;
+
+	for (h = hash_symbol(symbol, set->bits); set->slot[h] != 0; h = (h + 1) & mask) {
+		if (set->keyword[set->slot[h] - 1].symbol == symbol) {
+			return &set->keyword[set->slot[h] - 1];
 		}
 	}
+
+	return NULL;
 }
 
-static void
-initialize_dictionary(megahal_ctx_t ctx, struct megahal_dict *dictionary)
+/* Add a symbol to either end of the reply, noting any keyword it uses.
+ * Running out of room at either end doubles the buffer and centres the
+ * reply in it again. */
+static bool
+push_symbol(megahal_ctx_t ctx, struct generator *gen, uint32_t symbol, bool front)
 {
-	STRING word = { 7, "<ERROR>" };
-	STRING end = { 5, "<FIN>" };
+	struct keyword *keyword;
+	uint32_t capacity;
+	uint32_t head;
+	uint32_t *reply;
 
-	(void)add_word(ctx, dictionary, word);
-	(void)add_word(ctx, dictionary, end);
-}
+	if (front ? (gen->reply_head == 0) : ((gen->reply_head + gen->reply_size) == gen->reply_capacity)) {
+		capacity = (gen->reply_capacity == 0) ? 64 : (gen->reply_capacity * 2);
 
-static void
-load_dictionary(megahal_ctx_t ctx, FILE *file, struct megahal_dict *dictionary)
-{
-	register int i;
-	int size;
+		if (gen->reply == NULL) {
+			reply = (uint32_t *)af_malloc(ctx, sizeof(uint32_t) * capacity);
+		} else {
+			reply = (uint32_t *)af_realloc(ctx, gen->reply, sizeof(uint32_t) * capacity);
+		}
 
-	fread(&size, sizeof(uint32_t), 1, file);
+		if (reply == NULL) {
+			return false;
+		}
 
-	for (i = 0; i < size; ++i) {
-		load_word(ctx, file, dictionary);
-	}
-}
+		head = (capacity - gen->reply_size) / 2;
+		memmove(reply + head, reply + gen->reply_head, sizeof(uint32_t) * gen->reply_size);
 
-static int
-search_dictionary(struct megahal_dict *dictionary, STRING word, bool *find)
-{
-	int position;
-	int min;
-	int max;
-	int middle;
-	int compar;
+		gen->reply = reply;
+		gen->reply_head = head;
+		gen->reply_capacity = capacity;
+	}
 
-	/* If the dictionary is empty, then obviously the word won't be found */
-	if (!dictionary || dictionary->size == 0) {
-		position = 0;
-		goto notfound;
+	if (front) {
+		gen->reply_head -= 1;
+		gen->reply[gen->reply_head] = symbol;
+	} else {
+		gen->reply[gen->reply_head + gen->reply_size] = symbol;
 	}
 
-	/* Initialize the lower and upper bounds of the search */
-	min = 0;
-	max = dictionary->size - 1;
+	gen->reply_size += 1;
 
-	/* Search repeatedly, halving the search space each time, until either
-	 * the entry is found, or the search space becomes empty */
-	while (1) {
-		/* See whether the middle element of the search space is greater
-		 * than, equal to, or less than the element being searched for. */
-		middle = (min + max) / 2;
-		compar = wordcmp(word, dictionary->entry[dictionary->index[middle]]);
+	keyword = find_keyword(&gen->keys, symbol);
 
-		/* If it is equal then we have found the element.  Otherwise we
-		 * can halve the search space accordingly. */
-		if (compar == 0) {
-			position = middle;
-			goto found;
-		} else if (compar > 0) {
-			if (max == middle) {
-				position = middle + 1;
-				goto notfound;
-			}
-			min = middle + 1;
-		} else {
-			if (min == middle) {
-				position = middle;
-				goto notfound;
-			}
-			max = middle - 1;
-		}
+	if (keyword != NULL) {
+		keyword->used = true;
 	}
 
-found:
-	*find = true;
-	return position;
+	return true;
+}
 
-notfound:
-	*find = false;
-	return position;
+/* Each generator draws from its own sequence, seeded from the global one
+ * so that srand48() still makes replies repeatable.  The global sequence
+ * isn't thread-safe, hence the lock. */
+static uint64_t
+next_seed(void)
+{
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	long seed;
+
+	pthread_mutex_lock(&lock);
+	seed = lrand48();
+	pthread_mutex_unlock(&lock);
+
+	return (uint64_t)seed;
 }
 
 static void
-free_dictionary(megahal_ctx_t ctx, struct megahal_dict *dictionary)
+initialize_cursor(struct generator *gen, bool forward)
 {
-	if (dictionary == NULL) {
-		return;
-	}
+	struct megahal_model *model = gen->model;
+	register unsigned int i;
 
-	if (dictionary->entry != NULL) {
-		af_free(ctx, dictionary->entry);
-		dictionary->entry = NULL;
+	for (i = 0; i <= model->order; ++i) {
+		gen->cursor[i] = 0;
 	}
 
-	if (dictionary->index != NULL) {
-		af_free(ctx, dictionary->index);
-		dictionary->index = NULL;
+	/* Replies are generated from a snapshot when they have been given one. */
+	if (gen->snapshot != NULL) {
+		gen->view = forward ? &gen->snapshot->forward : &gen->snapshot->backward;
+		gen->cursor[0] = FROZEN_REF(0);
+	} else {
+		gen->view = NULL;
+		gen->cursor[0] = (NODEREF)(forward ? model->forward : model->backward);
 	}
-
-	dictionary->size = 0;
 }
 
 static void
-free_swap(megahal_ctx_t ctx, struct megahal_swaplist *swap)
+update_context(struct generator *gen, uint32_t symbol)
 {
-	register int i;
-
-	if (swap == NULL) {
-		return;
-	}
+	register unsigned int i;
 
-	for (i = 0; i < swap->size; ++i) {
-		free_word(ctx, swap->from[i]);
-		free_word(ctx, swap->to[i]);
+	for (i = (gen->model->order + 1); i > 0; --i) {
+		if (gen->cursor[i - 1] != 0) {
+			gen->cursor[i] = find_ref(gen->view, gen->cursor[i - 1], symbol);
+		}
 	}
-
-	af_free(ctx, swap->from);
-	af_free(ctx, swap->to);
-	af_free(ctx, swap);
 }
 
-static TREE *
-new_node(megahal_ctx_t ctx)
+/* Extend the context as update_context() does, and if the symbol is a
+ * preferred keyword, work out its term of the reply's surprise from the
+ * nodes found on the way.  Returns -1 if the symbol isn't scored, 0 if no
+ * context predicted it and 1 if *term was set. */
+static int
+score_context(struct generator *gen, uint32_t symbol, float *term)
 {
-	TREE *node = NULL;
+	struct keyword *keyword = find_keyword(&gen->keys, symbol);
+	register unsigned int i;
+	float probability = 0.0f;
+	int count = 0;
+	NODEREF previous;
+	NODEREF parent;
 
-	/* Allocate memory for the new node */
-	node = (TREE *)af_malloc(ctx, sizeof(TREE));
-	if (node == NULL) {
-		// TODO: error
-		//error("new_node", "Unable to allocate the node.");
-		goto fail;
+	if ((keyword == NULL) || !keyword->preferred) {
+		update_context(gen, symbol);
+		return -1;
 	}
 
-	/* Initialise the contents of the node */
-	node->symbol = 0;
-	node->usage = 0;
-	node->count = 0;
-	node->branch = 0;
-	node->tree = NULL;
+	/* Walk up from the root, so the probabilities add up in the same
+	 * order as they always have. */
+	parent = gen->cursor[0];
 
-	return node;
+	for (i = 1; i <= (unsigned int)(gen->model->order + 1); ++i) {
+		previous = gen->cursor[i];
 
-fail:
-	if (node != NULL) {
-		free(node);
+		if (parent != 0) {
+			gen->cursor[i] = find_ref(gen->view, parent, symbol);
+
+			if ((i <= (unsigned int)gen->model->order) && (gen->cursor[i] != 0)) {
+				probability += (float)ref_count(gen->view, gen->cursor[i]) / (float)ref_usage(gen->view, parent);
+				++count;
+			}
+		}
+
+		parent = previous;
 	}
 
-	return NULL;
+	if (count == 0) {
+		return 0;
+	}
+
+	*term = (float)log(probability / (float)count);
+
+	return 1;
 }
 
-static void
-load_tree(megahal_ctx_t ctx, FILE *file, TREE *node)
+void
+free_model(megahal_ctx_t ctx, struct megahal_model *model)
 {
-	register unsigned int i;
+	if (model == NULL) {
+		return;
+	}
 
-	fread(&(node->symbol), sizeof(uint16_t), 1, file);
-	fread(&(node->usage), sizeof(uint32_t), 1, file);
-	fread(&(node->count), sizeof(uint16_t), 1, file);
-	fread(&(node->branch), sizeof(uint16_t), 1, file);
+	stop_backlog(ctx, model);
+	stop_publishing(ctx, model);
+	free_deferred(ctx, model);
 
-	if (node->branch == 0) {
-		return;
+	/* Each trie lives entirely in its learner's node pool. */
+	free_pool(ctx, &model->learner[FORWARD].nodes);
+	free_pool(ctx, &model->learner[BACKWARD].nodes);
+
+	free_snapshot(ctx, model->frozen);
+
+	if (model->map != NULL) {
+		munmap(model->map, model->map_size);
 	}
 
-	node->tree = (TREE **)af_malloc(ctx, sizeof(TREE *) * (node->branch));
-	if (node->tree == NULL) {
-		//error("load_tree", "Unable to allocate subtree");
-		// TODO: Error
-		return;
+	if (model->learner[FORWARD].context != NULL) {
+		af_free(ctx, model->learner[FORWARD].context);
 	}
 
-	for (i = 0; i < node->branch; ++i) {
-		node->tree[i] = new_node(ctx);
-		load_tree(ctx, file, node->tree[i]);
+	if (model->learner[BACKWARD].context != NULL) {
+		af_free(ctx, model->learner[BACKWARD].context);
+	}
+
+	if (model->sentence != NULL) {
+		af_free(ctx, model->sentence);
+	}
+
+	if (model->dictionary != NULL) {
+		free_words(ctx, model->dictionary);
+		free_dictionary(ctx, model->dictionary);
+		af_free(ctx, model->dictionary);
 	}
+
+	pthread_mutex_destroy(&model->publisher.lock);
+	pthread_rwlock_destroy(&model->lock);
+	af_free(ctx, model);
 }
 
-static void
-free_tree(megahal_ctx_t ctx, TREE *tree)
+static bool
+learn(megahal_ctx_t ctx, struct megahal_model *model, struct megahal_dict *words)
 {
-	register unsigned int i;
+	bool ok;
 
-	if (tree == NULL) {
-		return;
+	/* We only learn from inputs which are long enough */
+	if (words->size <= (model->order)) {
+		return false;
 	}
 
-	if (tree->tree != NULL) {
-		for (i = 0; i < tree->branch; ++i) {
-			free_tree(ctx, tree->tree[i]);
-		}
+	pthread_rwlock_wrlock(&model->lock);
+	learn_deferred(ctx, model);
+	ok = learn_sentence(ctx, model, words);
 
-		af_free(ctx, tree->tree);
+	if (ok && (model->publisher.current != NULL)) {
+		publish_due(ctx, model, 1);
 	}
 
-	af_free(ctx, tree);
+	pthread_rwlock_unlock(&model->lock);
+
+	return ok;
 }
 
-static struct megahal_swaplist *
-new_swap(megahal_ctx_t ctx)
+/* Learn from the input of a reply made from a published snapshot by
+ * deferring it to the learners, so the reply never waits for the lock.
+ * Publishing is always left to learners, so a reply never pays for a
+ * freeze either. */
+static bool
+learn_reply(megahal_ctx_t ctx, struct megahal_model *model, struct megahal_dict *words)
 {
-	struct megahal_swaplist *list;
+	uint32_t waiting;
 
-	list = af_malloc(ctx, sizeof(*list));
+	if (words->size <= (model->order)) {
+		return false;
+	}
 
-	if (list == NULL) {
-		// error("new_swap", "Unable to allocate swap");
-		// TODO: Error
-		return NULL;
+	waiting = defer_sentence(ctx, model, words);
+
+	if (waiting == 0) {
+		return false;
 	}
 
-	list->size = 0;
-	list->from = NULL;
-	list->to = NULL;
+	/* A model that would have to be thawed is left for a learner. */
+	if ((waiting >= DEFERRED_LIMIT) && (pthread_rwlock_trywrlock(&model->lock) == 0)) {
+		if (model->live) {
+			learn_deferred(ctx, model);
+		}
 
-	return list;
+		pthread_rwlock_unlock(&model->lock);
+	}
+
+	return true;
 }
 
-static void
-add_swap(megahal_ctx_t ctx, struct megahal_swaplist *list, const char *s, const char *d)
+/* Copy the words of a sentence, which point into the caller's input, to
+ * the end of the deferred list, returning how many are now waiting or
+ * zero if it couldn't be copied. */
+static uint32_t
+defer_sentence(megahal_ctx_t ctx, struct megahal_model *model, struct megahal_dict *words)
 {
-	list->size += 1;
-
-	if (list->from == NULL) {
-		list->from = (STRING *)af_malloc(ctx, sizeof(STRING));
+	register unsigned int i;
+	struct deferred *sentence;
+	size_t length = 0;
+	uint32_t waiting;
+	char *text;
 
-		if (list->from == NULL) {
-			// error("add_swap", "Unable to allocate list->from");
-			// TODO: Error
-			return;
-		}
+	for (i = 0; i < words->size; ++i) {
+		length += words->entry[i].length;
 	}
 
-	if (list->to == NULL) {
-		list->to = (STRING *)af_malloc(ctx, sizeof(STRING));
-		if (list->to == NULL) {
-			//error("add_swap", "Unable to allocate list->to");
-			//TODO: Error
-			return;
-		}
-	}
+	sentence = af_malloc(ctx, sizeof(*sentence) + (sizeof(STRING) * words->size) + length);
 
-	list->from = (STRING *)af_realloc(ctx, list->from, sizeof(STRING) * (list->size));
-	if (list->from == NULL) {
-		//error("add_swap", "Unable to reallocate from");
-		//TODO: Error
-		return;
+	if (sentence == NULL) {
+		// TODO: Error
+		return 0;
 	}
 
-	list->to = (STRING *)af_realloc(ctx, list->to, sizeof(STRING) * (list->size));
-	if (list->to==NULL) {
-		//error("add_swap", "Unable to reallocate to");
-		//TODO: Error
-		return;
+	sentence->next = NULL;
+	sentence->size = words->size;
+	text = (char *)(sentence->word + words->size);
+
+	for (i = 0; i < words->size; ++i) {
+		memcpy(text, words->entry[i].word, words->entry[i].length);
+		sentence->word[i].length = words->entry[i].length;
+		sentence->word[i].word = text;
+		text += words->entry[i].length;
 	}
 
-	list->from[list->size - 1].length = strlen(s);
-	list->from[list->size - 1].word = af_strdup(ctx, s);
-	list->to[list->size - 1].length = strlen(d);
-	list->to[list->size - 1].word = af_strdup(ctx, d);
+	pthread_mutex_lock(&model->publisher.lock);
+	*model->publisher.tail = sentence;
+	model->publisher.tail = &sentence->next;
+	waiting = ++model->publisher.waiting;
+	pthread_mutex_unlock(&model->publisher.lock);
+
+	return waiting;
 }
 
-static int
-wordcmp(STRING word1, STRING word2)
+/* Learn the sentences replies have deferred, in the order they were
+ * deferred.  The caller holds the model's lock for writing. */
+static void
+learn_deferred(megahal_ctx_t ctx, struct megahal_model *model)
 {
-	register int i;
-	int bound;
+	struct deferred *sentence;
+	struct deferred *next;
+	struct megahal_dict words;
+
+	pthread_mutex_lock(&model->publisher.lock);
+	sentence = model->publisher.deferred;
+	model->publisher.deferred = NULL;
+	model->publisher.tail = &model->publisher.deferred;
+	model->publisher.waiting = 0;
+	pthread_mutex_unlock(&model->publisher.lock);
 
-	bound = MIN(word1.length, word2.length);
+	for (; sentence != NULL; sentence = next) {
+		next = sentence->next;
 
-	for (i = 0; i < bound; ++i) {
-		if (toupper(word1.word[i]) != toupper(word2.word[i])) {
-			return (int)(toupper(word1.word[i]) - toupper(word2.word[i]));
+		words.size = sentence->size;
+		words.entry = sentence->word;
+
+		if (learn_sentence(ctx, model, &words)) {
+			++model->publisher.pending;
 		}
-	}
 
-	if (word1.length < word2.length) {
-		return -1;
+		af_free(ctx, sentence);
 	}
+}
 
-	if (word1.length > word2.length) {
-		return 1;
+static void
+free_deferred(megahal_ctx_t ctx, struct megahal_model *model)
+{
+	struct deferred *sentence;
+	struct deferred *next;
+
+	for (sentence = model->publisher.deferred; sentence != NULL; sentence = next) {
+		next = sentence->next;
+		af_free(ctx, sentence);
 	}
 
-	return 0;
+	model->publisher.deferred = NULL;
+	model->publisher.tail = &model->publisher.deferred;
+	model->publisher.waiting = 0;
 }
 
+/* Count newly learned sentences and republish once either of the
+ * publishing limits has been reached. */
 static void
-upper(char *string)
+publish_due(megahal_ctx_t ctx, struct megahal_model *model, uint64_t sentences)
 {
-	register unsigned int i;
+	struct publisher *publisher = &model->publisher;
+
+	publisher->pending += (uint32_t)MIN(sentences, (uint64_t)(UINT32_MAX - publisher->pending));
 
-	for (i = 0; i < strlen(string); ++i) {
-		string[i] = (char)toupper((int)string[i]);
+	if (((publisher->every > 0) && (publisher->pending >= publisher->every)) ||
+	    ((publisher->interval > 0.0) && (elapsed_seconds(&publisher->last) >= publisher->interval))) {
+		publish_model(ctx, model);
 	}
 }
 
 static bool
-boundary(char *string, int position)
+learn_sentence(megahal_ctx_t ctx, struct megahal_model *model, struct megahal_dict *words)
 {
-	if (position == 0) {
+	register unsigned int i;
+	uint32_t *symbol;
+
+	if (!thaw_model(ctx, model)) {
 		return false;
 	}
 
-	if (position == (int)strlen(string)) {
-		return true;
+	/* Resolve the words to symbols once for both directions, straight
+	 * into the next backlog slot when there is a backward worker. */
+	if (model->backlog != NULL) {
+		symbol = reserve_backlog(ctx, model->backlog, words->size);
+	} else {
+		symbol = reserve_sentence(ctx, model, words->size);
 	}
 
-	if ((string[position] == '\'') &&
-	    (isalpha(string[position - 1]) != 0) &&
-	    (isalpha(string[position + 1]) != 0)) {
+	if (symbol == NULL) {
+		// TODO: Error
 		return false;
 	}
 
-	if ((position > 1) &&
-	    (string[position - 1]=='\'') &&
-	    (isalpha(string[position - 2]) != 0) &&
-	    (isalpha(string[position]) != 0)) {
-		return false;
-	}
+	/* Add the symbols to the model's dictionary if necessary.  Only the
+	 * wide format can record a word longer than a byte can count. */
+	for (i = 0; i < words->size; ++i) {
+		symbol[i] = add_word(ctx, model->dictionary, words->entry[i]);
 
-	if ((isalpha(string[position]) !=0 ) &&
-	    (isalpha(string[position - 1]) == 0)) {
-		return true;
+		if (words->entry[i].length > UINT8_MAX) {
+			model->wide = true;
+		}
 	}
 
-	if ((isalpha(string[position]) == 0) &&
-	    (isalpha(string[position - 1]) != 0)) {
-		return true;
-	}
+	/* Train the model in the forwards direction, and then either hand
+	 * the sentence to the backward worker or train backwards here. */
+	learn_symbols(ctx, model, FORWARD, symbol, words->size);
 
-	if (isdigit(string[position]) != isdigit(string[position - 1])) {
-		return true;
+	if (model->backlog != NULL) {
+		commit_backlog(model->backlog, words->size);
+	} else {
+		learn_symbols(ctx, model, BACKWARD, symbol, words->size);
+		model->wide |= model->learner[BACKWARD].wide;
 	}
 
-	return false;
+	model->wide |= model->learner[FORWARD].wide;
+
+	return true;
 }
 
-static TREE *
-add_symbol(megahal_ctx_t ctx, TREE *tree, uint16_t symbol)
+static void
+learn_symbols(megahal_ctx_t ctx, struct megahal_model *model, int direction, const uint32_t *symbol, uint32_t size)
 {
-	TREE *node = NULL;
+	struct learner *learner = &model->learner[direction];
+	register uint32_t i;
 
-	/* Search for the symbol in the subtree of the tree node. */
-	node = find_symbol_add(ctx, tree, symbol);
+	/* Start by initializing the context of the model. */
+	initialize_context(model, learner);
+	learner->context[0] = (direction == FORWARD) ? model->forward : model->backward;
 
-	/* Increment the symbol counts */
-	if (node->count < 65535) {
-		node->count += 1;
-		tree->usage += 1;
+	for (i = 0; i < size; ++i) {
+		update_model(ctx, model, learner, symbol[(direction == FORWARD) ? i : (size - 1 - i)]);
 	}
 
-	return node;
+	/* Add the sentence-terminating symbol. */
+	update_model(ctx, model, learner, 1);
 }
 
-static TREE *
-find_symbol(TREE *node, int symbol)
+static uint32_t *
+reserve_sentence(megahal_ctx_t ctx, struct megahal_model *model, uint32_t size)
 {
-	register unsigned int i;
-	TREE *found = NULL;
-	bool found_symbol = false;
+	uint32_t *sentence;
 
-	/* Perform a binary search for the symbol. */
-	i = search_node(node, symbol, &found_symbol);
-	if (found_symbol == true) {
-		found = node->tree[i];
+	if (size > model->sentence_capacity) {
+		if (model->sentence == NULL) {
+			sentence = (uint32_t *)af_malloc(ctx, sizeof(uint32_t) * size);
+		} else {
+			sentence = (uint32_t *)af_realloc(ctx, model->sentence, sizeof(uint32_t) * size);
+		}
+
+		if (sentence == NULL) {
+			return NULL;
+		}
+
+		model->sentence = sentence;
+		model->sentence_capacity = size;
 	}
 
-	return found;
+	return model->sentence;
 }
 
-static TREE *
-find_symbol_add(megahal_ctx_t ctx, TREE *node, int symbol)
+static bool
+start_backlog(megahal_ctx_t ctx, struct megahal_model *model)
 {
 	register unsigned int i;
-	TREE *found = NULL;
-	bool found_symbol = false;
+	struct backlog *backlog;
 
-	/* Perform a binary search for the symbol.  If the symbol isn't found,
-	 * attach a new sub-node to the tree node so that it remains sorted. */
-	i = search_node(node, symbol, &found_symbol);
+	if (model->backlog != NULL) {
+		return true;
+	}
 
-	if (found_symbol == true) {
-		found=node->tree[i];
-	} else {
-		found=new_node(ctx);
-		found->symbol = symbol;
-		add_node(ctx, node, found, i);
+	backlog = af_malloc(ctx, sizeof(*backlog));
+
+	if (backlog == NULL) {
+		// TODO: Error
+		return false;
 	}
 
-	return found;
+	backlog->ctx = ctx;
+	backlog->model = model;
+	backlog->head = 0;
+	backlog->tail = 0;
+	backlog->stop = false;
+
+	for (i = 0; i < BACKLOG_SLOTS; ++i) {
+		backlog->slot[i].symbol = NULL;
+		backlog->slot[i].size = 0;
+		backlog->slot[i].capacity = 0;
+	}
+
+	pthread_mutex_init(&backlog->lock, NULL);
+	pthread_cond_init(&backlog->queued, NULL);
+	pthread_cond_init(&backlog->drained, NULL);
+
+	if (pthread_create(&backlog->thread, NULL, backlog_worker, backlog) != 0) {
+		pthread_cond_destroy(&backlog->drained);
+		pthread_cond_destroy(&backlog->queued);
+		pthread_mutex_destroy(&backlog->lock);
+		af_free(ctx, backlog);
+		return false;
+	}
+
+	model->backlog = backlog;
+
+	return true;
 }
 
-static int
-search_node(TREE *node, int symbol, bool *found_symbol)
+static void
+stop_backlog(megahal_ctx_t ctx, struct megahal_model *model)
+{
+	register unsigned int i;
+	struct backlog *backlog = model->backlog;
+
+	if (backlog == NULL) {
+		return;
+	}
+
+	/* The worker finishes whatever is queued before it stops. */
+	pthread_mutex_lock(&backlog->lock);
+	backlog->stop = true;
+	pthread_cond_signal(&backlog->queued);
+	pthread_mutex_unlock(&backlog->lock);
+
+	pthread_join(backlog->thread, NULL);
+
+	pthread_cond_destroy(&backlog->drained);
+	pthread_cond_destroy(&backlog->queued);
+	pthread_mutex_destroy(&backlog->lock);
+
+	for (i = 0; i < BACKLOG_SLOTS; ++i) {
+		if (backlog->slot[i].symbol != NULL) {
+			af_free(ctx, backlog->slot[i].symbol);
+		}
+	}
+
+	af_free(ctx, backlog);
+	model->backlog = NULL;
+
+	model->wide |= model->learner[BACKWARD].wide;
+}
+
+/* Wait for the backward worker to catch up, so that the backward trie can
+ * be read. */
+static void
+sync_model(struct megahal_model *model)
+{
+	if (model->backlog == NULL) {
+		return;
+	}
+
+	drain_backlog(model->backlog);
+	model->wide |= model->learner[BACKWARD].wide;
+}
+
+/* Replies only need the backward trie to be caught up, and can't fold its
+ * width into the model while other replies may be reading it. */
+static void
+drain_backlog(struct backlog *backlog)
+{
+	if (backlog == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&backlog->lock);
+
+	while (backlog->head != backlog->tail) {
+		pthread_cond_wait(&backlog->drained, &backlog->lock);
+	}
+
+	pthread_mutex_unlock(&backlog->lock);
+}
+
+static uint32_t *
+reserve_backlog(megahal_ctx_t ctx, struct backlog *backlog, uint32_t size)
+{
+	struct backlog_slot *slot;
+	uint32_t *symbol;
+
+	/* Wait for a free slot.  Only this thread moves the tail, so the
+	 * slot stays ours until it is committed. */
+	pthread_mutex_lock(&backlog->lock);
+
+	while ((backlog->tail - backlog->head) == BACKLOG_SLOTS) {
+		pthread_cond_wait(&backlog->drained, &backlog->lock);
+	}
+
+	slot = &backlog->slot[backlog->tail % BACKLOG_SLOTS];
+
+	pthread_mutex_unlock(&backlog->lock);
+
+	if (size > slot->capacity) {
+		if (slot->symbol == NULL) {
+			symbol = (uint32_t *)af_malloc(ctx, sizeof(uint32_t) * size);
+		} else {
+			symbol = (uint32_t *)af_realloc(ctx, slot->symbol, sizeof(uint32_t) * size);
+		}
+
+		if (symbol == NULL) {
+			return NULL;
+		}
+
+		slot->symbol = symbol;
+		slot->capacity = size;
+	}
+
+	return slot->symbol;
+}
+
+static void
+commit_backlog(struct backlog *backlog, uint32_t size)
+{
+	pthread_mutex_lock(&backlog->lock);
+
+	backlog->slot[backlog->tail % BACKLOG_SLOTS].size = size;
+	backlog->tail += 1;
+
+	pthread_cond_signal(&backlog->queued);
+	pthread_mutex_unlock(&backlog->lock);
+}
+
+static void *
+backlog_worker(void *arg)
+{
+	struct backlog *backlog = (struct backlog *)arg;
+	struct backlog_slot *slot;
+
+	pthread_mutex_lock(&backlog->lock);
+
+	while (true) {
+		while ((backlog->head == backlog->tail) && !backlog->stop) {
+			pthread_cond_wait(&backlog->queued, &backlog->lock);
+		}
+
+		if (backlog->head == backlog->tail) {
+			break;
+		}
+
+		slot = &backlog->slot[backlog->head % BACKLOG_SLOTS];
+
+		pthread_mutex_unlock(&backlog->lock);
+		learn_symbols(backlog->ctx, backlog->model, BACKWARD, slot->symbol, slot->size);
+		pthread_mutex_lock(&backlog->lock);
+
+		backlog->head += 1;
+		pthread_cond_broadcast(&backlog->drained);
+	}
+
+	pthread_mutex_unlock(&backlog->lock);
+
+	return NULL;
+}
+
+/* Learn each complete line in the data, in place.  Unless this is the
+ * final piece of input, a trailing line without a newline is left for the
+ * caller to complete.  Returns the number of bytes consumed. */
+static size_t
+learn_lines(megahal_ctx_t ctx, struct megahal_model *model, struct megahal_dict *words, const char *data, size_t length, bool final, megahal_learn_stats_t *stats)
+{
+	const char *line = data;
+	const char *end = data + length;
+	const char *newline;
+	size_t size;
+
+	while (line < end) {
+		newline = memchr(line, '\n', end - line);
+
+		if (newline == NULL) {
+			if (!final) {
+				break;
+			}
+
+			newline = end;
+		}
+
+		size = newline - line;
+
+		if ((size > 0) && (line[size - 1] == '\r')) {
+			--size;
+		}
+
+		make_words(ctx, line, size, words);
+
+		if (stats != NULL) {
+			stats->lines += 1;
+
+			if (learn(ctx, model, words)) {
+				stats->sentences += 1;
+			}
+		} else {
+			learn(ctx, model, words);
+		}
+
+		line = (newline < end) ? newline + 1 : end;
+	}
+
+	if (stats != NULL) {
+		stats->bytes += line - data;
+	}
+
+	return line - data;
+}
+
+static bool
+learn_stream(megahal_ctx_t ctx, struct megahal_model *model, FILE *file, int fd, megahal_learn_stats_t *stats)
+{
+	struct megahal_dict *words;
+	struct timespec start;
+	size_t size = READER_BUFFER;
+	size_t used = 0;
+	size_t done;
+	ssize_t got;
+	char *buffer;
+	char *grown;
+	bool ok = true;
+
+	words = new_dictionary(ctx);
+	buffer = (char *)af_malloc(ctx, size);
+
+	if ((words == NULL) || (buffer == NULL)) {
+		// TODO: Error
+		ok = false;
+		goto done;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	start_stats(stats);
+
+	while (true) {
+		/* A line longer than the buffer needs a bigger buffer. */
+		if (used == size) {
+			grown = (char *)af_realloc(ctx, buffer, size * 2);
+
+			if (grown == NULL) {
+				// TODO: Error
+				ok = false;
+				break;
+			}
+
+			buffer = grown;
+			size *= 2;
+		}
+
+		if (file != NULL) {
+			got = fread(buffer + used, sizeof(char), size - used, file);
+
+			if ((got == 0) && ferror(file)) {
+				ok = false;
+				break;
+			}
+		} else {
+			got = read(fd, buffer + used, size - used);
+
+			if (got < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+
+				ok = false;
+				break;
+			}
+		}
+
+		if (got == 0) {
+			learn_lines(ctx, model, words, buffer, used, true, stats);
+			break;
+		}
+
+		used += got;
+		done = learn_lines(ctx, model, words, buffer, used, false, stats);
+
+		/* Keep the partial line at the end for the next read. */
+		memmove(buffer, buffer + done, used - done);
+		used -= done;
+	}
+
+	finish_stats(stats, &start);
+
+done:
+	if (buffer != NULL) {
+		af_free(ctx, buffer);
+	}
+
+	if (words != NULL) {
+		free_dictionary(ctx, words);
+		af_free(ctx, words);
+	}
+
+	return ok;
+}
+
+static bool
+learn_parallel(megahal_ctx_t ctx, struct megahal_model *model, const char *data, size_t length, unsigned int threads, megahal_learn_stats_t *stats)
+{
+	register unsigned int i;
+	struct shard shard[MAX_SHARDS];
+	pthread_t thread[MAX_SHARDS];
+	bool started[MAX_SHARDS];
+	struct megahal_dict *words;
+	struct timespec start;
+	const char *line = data;
+	const char *end = data + length;
+	const char *cut;
+	bool ok = true;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	start_stats(stats);
+
+	if (threads == 0) {
+		threads = (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	threads = MIN(MAX(threads, 1u), MAX_SHARDS);
+
+	/* With a single worker there is nothing to merge. */
+	if (threads == 1) {
+		words = new_dictionary(ctx);
+
+		if (words == NULL) {
+			return false;
+		}
+
+		learn_lines(ctx, model, words, data, length, true, stats);
+		finish_stats(stats, &start);
+
+		free_dictionary(ctx, words);
+		af_free(ctx, words);
+
+		return true;
+	}
+
+	/* Cut the input into runs of roughly equal size, each ending just
+	 * after a newline. */
+	for (i = 0; i < threads; ++i) {
+		cut = (i == threads - 1) ? end : line + ((end - line) / (threads - i));
+
+		if (cut < end) {
+			cut = memchr(cut, '\n', end - cut);
+			cut = (cut == NULL) ? end : cut + 1;
+		}
+
+		shard[i].ctx = ctx;
+		shard[i].model = NULL;
+		shard[i].data = line;
+		shard[i].length = cut - line;
+		shard[i].order = model->order;
+		shard[i].ok = false;
+
+		line = cut;
+	}
+
+	for (i = 0; i < threads; ++i) {
+		started[i] = (pthread_create(&thread[i], NULL, learn_shard, &shard[i]) == 0);
+
+		if (!started[i]) {
+			learn_shard(&shard[i]);
+		}
+	}
+
+	for (i = 0; i < threads; ++i) {
+		if (started[i]) {
+			pthread_join(thread[i], NULL);
+		}
+	}
+
+	/* Merge in input order, even past a failed shard, so every shard
+	 * model is freed. */
+	for (i = 0; i < threads; ++i) {
+		pthread_rwlock_wrlock(&model->lock);
+
+		if (!shard[i].ok || !merge_model(ctx, model, shard[i].model)) {
+			ok = false;
+		} else if (model->publisher.current != NULL) {
+			publish_due(ctx, model, shard[i].stats.sentences);
+		}
+
+		/* Replies see everything that was merged once the last shard
+		 * is in, whatever the publishing limits. */
+		if ((i == threads - 1) && (model->publisher.current != NULL) && (model->publisher.pending > 0)) {
+			publish_model(ctx, model);
+		}
+
+		pthread_rwlock_unlock(&model->lock);
+
+		if (stats != NULL) {
+			stats->lines += shard[i].stats.lines;
+			stats->sentences += shard[i].stats.sentences;
+			stats->bytes += shard[i].stats.bytes;
+		}
+
+		free_model(ctx, shard[i].model);
+	}
+
+	finish_stats(stats, &start);
+
+	return ok;
+}
+
+static void *
+learn_shard(void *arg)
+{
+	struct shard *shard = (struct shard *)arg;
+	struct megahal_dict *words;
+
+	start_stats(&shard->stats);
+
+	shard->model = new_model(shard->ctx, shard->order);
+	words = new_dictionary(shard->ctx);
+
+	if ((shard->model != NULL) && (words != NULL)) {
+		learn_lines(shard->ctx, shard->model, words, shard->data, shard->length, true, &shard->stats);
+		shard->ok = true;
+	}
+
+	if (words != NULL) {
+		free_dictionary(shard->ctx, words);
+		af_free(shard->ctx, words);
+	}
+
+	return NULL;
+}
+
+static bool
+merge_model(megahal_ctx_t ctx, struct megahal_model *model, struct megahal_model *shard)
+{
+	register unsigned int i;
+	uint32_t *remap;
+
+	sync_model(model);
+
+	if (!thaw_model(ctx, model)) {
+		return false;
+	}
+
+	remap = (uint32_t *)af_malloc(ctx, sizeof(uint32_t) * shard->dictionary->size);
+
+	if (remap == NULL) {
+		// TODO: Error
+		return false;
+	}
+
+	/* The shard's words get the model's symbols, new ones in the order
+	 * the shard first saw them. */
+	for (i = 0; i < shard->dictionary->size; ++i) {
+		remap[i] = add_word(ctx, model->dictionary, shard->dictionary->entry[i]);
+
+		if ((remap[i] >= UINT16_MAX) || (shard->dictionary->entry[i].length > UINT8_MAX)) {
+			model->wide = true;
+		}
+	}
+
+	merge_tree(ctx, model, &model->learner[FORWARD].nodes, model->forward, shard->forward, remap);
+	merge_tree(ctx, model, &model->learner[BACKWARD].nodes, model->backward, shard->backward, remap);
+
+	af_free(ctx, remap);
+
+	return true;
+}
+
+static void
+merge_tree(megahal_ctx_t ctx, struct megahal_model *model, struct node_pool *pool, TREE *into, TREE *from, const uint32_t *remap)
+{
+	register unsigned int i;
+	TREE *child;
+	TREE *node;
+
+	into->usage = (from->usage > UINT32_MAX - into->usage) ? UINT32_MAX : into->usage + from->usage;
+
+	for (i = 0; i < from->branch; ++i) {
+		child = node_child(from, i);
+		node = find_symbol_add(ctx, pool, into, remap[child->symbol]);
+		node->count = (child->count > UINT32_MAX - node->count) ? UINT32_MAX : node->count + child->count;
+
+		if (node->count > UINT16_MAX) {
+			model->wide = true;
+		}
+
+		merge_tree(ctx, model, pool, node, child, remap);
+	}
+}
+
+static void
+start_stats(megahal_learn_stats_t *stats)
+{
+	if (stats == NULL) {
+		return;
+	}
+
+	stats->lines = 0;
+	stats->sentences = 0;
+	stats->bytes = 0;
+	stats->seconds = 0.0;
+	stats->sentences_per_sec = 0.0;
+}
+
+static void
+finish_stats(megahal_learn_stats_t *stats, const struct timespec *start)
+{
+	if (stats == NULL) {
+		return;
+	}
+
+	stats->seconds = elapsed_seconds(start);
+	stats->sentences_per_sec = (stats->seconds > 0.0) ? ((double)stats->sentences / stats->seconds) : 0.0;
+}
+
+static bool
+load_model(megahal_ctx_t ctx, const char *filename, struct megahal_model *model)
+{
+	FILE *file;
+	char cookie[16];
+
+	if (filename == NULL) {
+		return false;
+	}
+
+	file = fopen(filename, "rb");
+
+	if (file == NULL) {
+		// warn("load_model", "Unable to open file `%s'", filename);
+		// TODO: warn
+		return false;
+	}
+
+	fread(cookie, sizeof(char), strlen(COOKIE), file);
+
+	if (strncmp(cookie, COOKIE, strlen(COOKIE)) == 0) {
+		model->wide = false;
+	} else if (strncmp(cookie, WIDE_COOKIE, strlen(WIDE_COOKIE)) == 0) {
+		model->wide = true;
+	} else {
+		// TODO: warn
+		//warn("load_model", "File `%s' is not a MegaHAL brain", filename);
+		goto fail;
+	}
+
+	fread(&(model->order), sizeof(uint8_t), 1, file);
+	load_tree(ctx, &model->learner[FORWARD].nodes, file, model->forward, model->wide);
+	load_tree(ctx, &model->learner[BACKWARD].nodes, file, model->backward, model->wide);
+	load_dictionary(ctx, file, model->dictionary, model->wide);
+
+	fclose(file);
+
+	return true;
+fail:
+	fclose(file);
+
+	return false;
+}
+
+static void
+update_model(megahal_ctx_t ctx, struct megahal_model *model, struct learner *learner, uint32_t symbol)
+{
+	register unsigned int i;
+
+	/* Update all of the models in the current context with the specified
+	 * symbol. */
+	for (i = (model->order + 1); i > 0; --i) {
+		if (learner->context[i - 1] != NULL) {
+			learner->context[i] = add_symbol(ctx, &learner->nodes, learner->context[i - 1], symbol);
+
+			if ((learner->context[i] != NULL) && (learner->context[i]->count > UINT16_MAX)) {
+				learner->wide = true;
+			}
+		}
+	}
+
+	/* The top 16 bit symbol is left free so that no node can have more
+	 * children than a 16 bit branch count can record. */
+	if (symbol >= UINT16_MAX) {
+		learner->wide = true;
+	}
+
+	return;
+}
+
+static uint32_t
+add_word(megahal_ctx_t ctx, struct megahal_dict *dictionary, STRING word)
+{
+	uint32_t hash = hash_word(word);
+	uint32_t slot;
+	STRING copy;
+
+	/* If the word's already in the dictionary, there is no need to add it */
+	if (search_dictionary(dictionary, word, hash, &slot) == true) {
+		return dictionary->table[slot];
+	}
+
+	/* Copy the new word for the dictionary to keep.  Input is tokenized
+	 * in place, so this is where it gets folded to upper case. */
+	copy.length = word.length;
+	copy.word = (char *)af_malloc(ctx, sizeof(char) * (word.length));
+	if (copy.word == NULL) {
+		// error("add_word", "Unable to allocate the word.");
+		return 0;
+	}
+
+	fold_upper(character_table(), copy.word, word.word, word.length);
+
+	return append_word(ctx, dictionary, copy, hash);
+}
+
+static bool
+grow_dictionary(megahal_ctx_t ctx, struct megahal_dict *dictionary)
+{
+	register unsigned int i;
+	uint32_t capacity = (dictionary->capacity == 0) ? 8 : (dictionary->capacity * 2);
+	uint32_t mask = (capacity * 2) - 1;
+	uint32_t *table;
+	uint32_t h;
+	STRING *entry;
+	uint32_t *hash;
+
+	if (dictionary->entry == NULL) {
+		entry = (STRING *)af_malloc(ctx, sizeof(STRING) * capacity);
+	} else {
+		entry = (STRING *)af_realloc(ctx, dictionary->entry, sizeof(STRING) * capacity);
+	}
+
+	if (entry == NULL) {
+		// error("add_word", "Unable to reallocate the dictionary to %d elements.", dictionary->size);
+		// TODO: Error
+		return false;
+	}
+	dictionary->entry = entry;
+
+	if (dictionary->hash == NULL) {
+		hash = (uint32_t *)af_malloc(ctx, sizeof(uint32_t) * capacity);
+	} else {
+		hash = (uint32_t *)af_realloc(ctx, dictionary->hash, sizeof(uint32_t) * capacity);
+	}
+
+	if (hash == NULL) {
+		return false;
+	}
+	dictionary->hash = hash;
+
+	/* Keep the table at most half full, re-slotting from the stored
+	 * hashes. */
+	table = (uint32_t *)af_malloc(ctx, sizeof(uint32_t) * (mask + 1));
+	if (table == NULL) {
+		return false;
+	}
+
+	for (i = 0; i <= mask; ++i) {
+		table[i] = DICT_EMPTY;
+	}
+
+	for (i = 0; i < dictionary->size; ++i) {
+		for (h = hash[i] & mask; table[h] != DICT_EMPTY; h = (h + 1) & mask) {
+			;
+		}
+
+		table[h] = i;
+	}
+
+	if (dictionary->table != NULL) {
+		af_free(ctx, dictionary->table);
+	}
+
+	dictionary->table = table;
+	dictionary->mask = mask;
+	dictionary->capacity = capacity;
+
+	return true;
+}
+
+static uint32_t
+append_word(megahal_ctx_t ctx, struct megahal_dict *dictionary, STRING word, uint32_t hash)
+{
+	uint32_t symbol = dictionary->size;
+	uint32_t h;
+
+	if ((dictionary->size == dictionary->capacity) && !grow_dictionary(ctx, dictionary)) {
+		return 0;
+	}
+
+	dictionary->entry[symbol] = word;
+	dictionary->hash[symbol] = hash;
+	dictionary->size += 1;
+
+	for (h = hash & dictionary->mask; dictionary->table[h] != DICT_EMPTY; h = (h + 1) & dictionary->mask) {
+		;
+	}
+
+	dictionary->table[h] = symbol;
+
+	return symbol;
+}
+
+static void
+save_word(struct writer *writer, STRING word, bool wide)
+{
+	save_number(writer, word.length, sizeof(uint8_t), wide);
+	writer_put(writer, word.word, word.length);
+}
+
+
+static void
+load_word(megahal_ctx_t ctx, FILE *file, struct megahal_dict *dictionary, bool wide)
+{
+	STRING word;
+
+	word.length = load_number(file, sizeof(uint8_t), wide);
+	word.word = (char *)af_malloc(ctx, sizeof(char) * word.length);
+
+	if (word.word == NULL) {
+		// TODO: Error
+		// error("load_word", "Unable to allocate word");
+		return;
+	}
+
+	if (fread(word.word, sizeof(char), word.length, file) != word.length) {
+		// TODO: Error
+		af_free(ctx, word.word);
+		return;
+	}
+
+	add_word(ctx, dictionary, word);
+	af_free(ctx, word.word);
+}
+
+/* Split the input into a list of words which point into it, so it is
+ * never copied or modified; the list's array is kept between calls. */
+static void
+make_words(megahal_ctx_t ctx, const char *input, size_t length, struct megahal_dict *words)
+{
+	STRING *last;
+
+	words->size = 0;
+
+	/* If the string is empty then do nothing, for it contains no words. */
+	if (length == 0) {
+		return;
+	}
+
+	if (ctx->tokenizer == MEGAHAL_TOKENIZER_UTF8) {
+		split_utf8(ctx, input, length, words);
+	} else {
+		split_bytes(ctx, input, length, words);
+	}
+
+	if (words->size == 0) {
+		return;
+	}
+
+	/* If the last word isn't punctuation, then replace it with a full-stop
+	 * character. */
+	last = &words->entry[words->size - 1];
+
+	if (alnum_word(ctx, *last)) {
+		if (!push_word(ctx, words, ".", 1)) {
+			// error("make_words", "Unable to reallocate dictionary");
+			// TODO: Error
+			return;
+		}
+	} else if (strchr("!.?", last->word[last->length - 1]) == NULL) {
+		last->length = 1;
+		last->word = ".";
+	}
+
+	return;
+}
+
+/* Split the input a byte at a time, comparing each byte to the one before
+ * it. */
+static void
+split_bytes(megahal_ctx_t ctx, const char *input, size_t length, struct megahal_dict *words)
+{
+	const unsigned char *s = (const unsigned char *)input;
+	const uint8_t *classes = character_table()->class;
+	size_t start = 0;
+	size_t position;
+
+	for (position = 1; position <= length; ++position) {
+		/* If the current character is of the same type as the previous
+		 * character, then include it in the word.  Otherwise, terminate
+		 * the current word.  Words are cut at the longest a STRING can
+		 * hold. */
+		if (!boundary(s, classes, start, position, length) && ((position - start) != UINT32_MAX)) {
+			continue;
+		}
+
+		/* Add the word to the dictionary */
+		if (!push_word(ctx, words, input + start, position - start)) {
+			// TODO: Error
+			// error("make_words", "Unable to reallocate dictionary");
+			return;
+		}
+
+		start = position;
+	}
+}
+
+/* Split the input a code point at a time, by the same rules as bytes are
+ * split, except that ideographs are words of their own.  Words are only
+ * ever cut between code points, and bytes that aren't valid UTF-8 are
+ * taken to be punctuation. */
+static void
+split_utf8(megahal_ctx_t ctx, const char *input, size_t length, struct megahal_dict *words)
+{
+	const struct char_table *table = character_table();
+	const unsigned char *s = (const unsigned char *)input;
+	size_t start = 0;
+	size_t position;
+	size_t width;
+	size_t next_width = 0;
+	size_t count = 0;
+	uint8_t before = 0;
+	uint8_t previous = 0;
+	uint8_t current;
+	uint8_t next;
+	bool split;
+
+	current = utf8_class(table, s, length, &width);
+
+	for (position = 0; position < length; ) {
+		next = ((position + width) < length) ? utf8_class(table, s + position + width, length - position - width, &next_width) : 0;
+
+		if (count == 0) {
+			split = false;
+		} else if (((current & CHAR_QUOTE) != 0) && ((previous & (CHAR_ALPHA | CHAR_SINGLE)) == CHAR_ALPHA) &&
+		           ((next & (CHAR_ALPHA | CHAR_SINGLE)) == CHAR_ALPHA)) {
+			split = false;
+		} else if ((count > 1) && ((previous & CHAR_QUOTE) != 0) && ((before & (CHAR_ALPHA | CHAR_SINGLE)) == CHAR_ALPHA) &&
+		           ((current & (CHAR_ALPHA | CHAR_SINGLE)) == CHAR_ALPHA)) {
+			split = false;
+		} else {
+			split = ((((current ^ previous) & (CHAR_ALPHA | CHAR_DIGIT)) != 0) ||
+			         (((current | previous) & CHAR_SINGLE) != 0));
+		}
+
+		if (split || (((position - start) + width) > UINT32_MAX)) {
+			if (!push_word(ctx, words, input + start, position - start)) {
+				// TODO: Error
+				return;
+			}
+
+			start = position;
+			count = 0;
+		}
+
+		position += width;
+		before = previous;
+		previous = current;
+		current = next;
+		width = next_width;
+		++count;
+	}
+
+	if (!push_word(ctx, words, input + start, length - start)) {
+		// TODO: Error
+		return;
+	}
+}
+
+static bool
+push_word(megahal_ctx_t ctx, struct megahal_dict *words, const char *word, size_t length)
+{
+	uint32_t capacity;
+	STRING *entry;
+
+	/* A word list only ever uses its entry array, so its capacity can
+	 * grow independently of the hash arrays a dictionary would have. */
+	if (words->size == words->capacity) {
+		capacity = (words->capacity == 0) ? 16 : (words->capacity * 2);
+
+		if (words->entry == NULL) {
+			entry = (STRING *)af_malloc(ctx, sizeof(STRING) * capacity);
+		} else {
+			entry = (STRING *)af_realloc(ctx, words->entry, sizeof(STRING) * capacity);
+		}
+
+		if (entry == NULL) {
+			return false;
+		}
+
+		words->entry = entry;
+		words->capacity = capacity;
+	}
+
+	words->entry[words->size].length = (uint32_t)length;
+	words->entry[words->size].word = (char *)word;
+	words->size += 1;
+
+	return true;
+}
+
+static uint32_t
+find_word(struct megahal_dict *dictionary, STRING word)
+{
+	uint32_t slot;
+
+	if (!dictionary) {
+		return 0;
+	}
+
+	if (search_dictionary(dictionary, word, hash_word(word), &slot) == true) {
+		return dictionary->table[slot];
+	} else {
+		return 0;
+	}
+}
+
+static void
+free_word(megahal_ctx_t ctx, STRING word)
+{
+	af_free(ctx, word.word);
+}
+
+static void
+free_words(megahal_ctx_t ctx, struct megahal_dict *words)
+{
+	register unsigned int i;
+
+	if (words == NULL) {
+		return;
+	}
+
+	/* Borrowed words point into a mapped brain. */
+	if (words->entry != NULL) {
+		for (i = words->borrowed; i < words->size; ++i) {
+			free_word(ctx, words->entry[i]);
+		}
+	}
+}
+
+static void
+initialize_dictionary(megahal_ctx_t ctx, struct megahal_dict *dictionary)
+{
+	STRING word = { 7, "<ERROR>" };
+	STRING end = { 5, "<FIN>" };
+
+	(void)add_word(ctx, dictionary, word);
+	(void)add_word(ctx, dictionary, end);
+}
+
+static void
+load_dictionary(megahal_ctx_t ctx, FILE *file, struct megahal_dict *dictionary, bool wide)
+{
+	register uint32_t i;
+	uint32_t size;
+
+	size = load_number(file, sizeof(uint32_t), wide);
+
+	for (i = 0; i < size; ++i) {
+		load_word(ctx, file, dictionary, wide);
+	}
+}
+
+static uint32_t
+hash_word(STRING word)
+{
+	const uint8_t *upper = character_table()->upper;
+	register unsigned int i;
+	uint32_t hash = 2166136261u;
+
+	/* FNV-1a over the upper-cased word, to match same_word(). */
+	for (i = 0; i < word.length; ++i) {
+		hash = (hash ^ upper[(unsigned char)word.word[i]]) * 16777619u;
+	}
+
+	return hash;
+}
+
+static bool
+search_dictionary(struct megahal_dict *dictionary, STRING word, uint32_t hash, uint32_t *slot)
+{
+	uint32_t symbol;
+	uint32_t h;
+
+	/* If the dictionary is empty, then obviously the word won't be found */
+	if (!dictionary || dictionary->table == NULL) {
+		return false;
+	}
+
+	/* Probe from the word's home slot until it or an empty slot turns up,
+	 * comparing text only when the stored hashes agree. */
+	for (h = hash & dictionary->mask; (symbol = dictionary->table[h]) != DICT_EMPTY; h = (h + 1) & dictionary->mask) {
+		if ((dictionary->hash[symbol] == hash) &&
+		    same_word(word, dictionary->entry[symbol])) {
+			*slot = h;
+			return true;
+		}
+	}
+
+	*slot = h;
+	return false;
+}
+
+static void
+free_dictionary(megahal_ctx_t ctx, struct megahal_dict *dictionary)
+{
+	if (dictionary == NULL) {
+		return;
+	}
+
+	if (dictionary->entry != NULL) {
+		af_free(ctx, dictionary->entry);
+		dictionary->entry = NULL;
+	}
+
+	if (dictionary->hash != NULL) {
+		af_free(ctx, dictionary->hash);
+		dictionary->hash = NULL;
+	}
+
+	if (dictionary->table != NULL) {
+		af_free(ctx, dictionary->table);
+		dictionary->table = NULL;
+	}
+
+	dictionary->size = 0;
+	dictionary->capacity = 0;
+	dictionary->borrowed = 0;
+	dictionary->mask = 0;
+}
+
+/* Empty a dictionary of its own words, keeping its arrays for reuse. */
+static void
+clear_dictionary(megahal_ctx_t ctx, struct megahal_dict *dictionary)
+{
+	register uint32_t i;
+
+	free_words(ctx, dictionary);
+
+	if (dictionary->table != NULL) {
+		for (i = 0; i <= dictionary->mask; ++i) {
+			dictionary->table[i] = DICT_EMPTY;
+		}
+	}
+
+	dictionary->size = 0;
+	dictionary->borrowed = 0;
+}
+
+static void
+free_swap(megahal_ctx_t ctx, struct megahal_swaplist *swap)
+{
+	register int i;
+
+	if (swap == NULL) {
+		return;
+	}
+
+	for (i = 0; i < swap->size; ++i) {
+		free_word(ctx, swap->from[i]);
+		free_word(ctx, swap->to[i]);
+	}
+
+	af_free(ctx, swap->from);
+	af_free(ctx, swap->to);
+
+	if (swap->hash != NULL) {
+		af_free(ctx, swap->hash);
+	}
+
+	if (swap->next != NULL) {
+		af_free(ctx, swap->next);
+	}
+
+	if (swap->slot != NULL) {
+		af_free(ctx, swap->slot);
+	}
+
+	af_free(ctx, swap);
+}
+
+static void
+init_pool(struct node_pool *pool)
+{
+	register unsigned int i;
+
+	pool->slab = NULL;
+	pool->slab_size = POOL_MIN_SLAB;
+
+	for (i = 0; i < POOL_CLASSES; ++i) {
+		pool->spare[i] = NULL;
+		pool->hashed[i] = NULL;
+	}
+}
+
+static void *
+pool_alloc(megahal_ctx_t ctx, struct node_pool *pool, size_t sz)
+{
+	struct pool_slab *slab = pool->slab;
+	size_t size;
+	void *ptr;
+
+	sz = (sz + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+
+	if ((slab == NULL) || ((slab->size - slab->used) < sz)) {
+		/* Oversized requests get a slab of their own, linked in behind
+		 * the current one so that its free space isn't abandoned. */
+		size = pool->slab_size;
+		if (sz > (size / 4)) {
+			size = sz;
+		}
+
+		slab = af_malloc(ctx, sizeof(struct pool_slab) + size);
+		if (slab == NULL) {
+			// TODO: Error
+			return NULL;
+		}
+
+		slab->size = size;
+		slab->used = 0;
+
+		if ((size == sz) && (pool->slab != NULL)) {
+			slab->next = pool->slab->next;
+			pool->slab->next = slab;
+		} else {
+			slab->next = pool->slab;
+			pool->slab = slab;
+
+			/* Grow the slab size along with the trie. */
+			if (pool->slab_size < POOL_MAX_SLAB) {
+				pool->slab_size *= 2;
+			}
+		}
+	}
+
+	ptr = (char *)(slab + 1) + slab->used;
+	slab->used += sz;
+
+	return ptr;
+}
+
+static void
+free_pool(megahal_ctx_t ctx, struct node_pool *pool)
+{
+	struct pool_slab *slab;
+	struct pool_slab *next;
+
+	for (slab = pool->slab; slab != NULL; slab = next) {
+		next = slab->next;
+		af_free(ctx, slab);
+	}
+
+	init_pool(pool);
+}
+
+static unsigned int
+children_class(unsigned int branch)
+{
+	unsigned int class = 0;
+
+	while ((1u << class) < branch) {
+		++class;
+	}
+
+	return class;
+}
+
+static inline TREE *
+node_child(const TREE *node, unsigned int i)
+{
+	return (node->branch == 1) ? node->only : node->tree[i];
+}
+
+/* Find the spare list for a child array with room for branch children,
+ * and the size of such an array.  A hashed array's index has twice as
+ * many slots as the array, as child_index() expects. */
+static void **
+spare_children(struct node_pool *pool, unsigned int branch, size_t *size)
+{
+	unsigned int class = children_class(branch);
+
+	if (branch > FANOUT_HASHED) {
+		*size = (sizeof(TREE *) << class) + (sizeof(uint32_t) << (class + 1));
+		return &pool->hashed[class];
+	}
+
+	*size = sizeof(TREE *) << class;
+	return &pool->spare[class];
+}
+
+static TREE **
+new_children(megahal_ctx_t ctx, struct node_pool *pool, unsigned int branch)
+{
+	size_t size;
+	void **spare = spare_children(pool, branch, &size);
+	TREE **children;
+
+	if (*spare != NULL) {
+		children = *spare;
+		*spare = *(void **)children;
+
+		return children;
+	}
+
+	return (TREE **)pool_alloc(ctx, pool, size);
+}
+
+static void
+free_children(struct node_pool *pool, TREE **children, unsigned int branch)
+{
+	size_t size;
+	void **spare;
+
+	if (branch <= 1) {
+		return;
+	}
+
+	spare = spare_children(pool, branch, &size);
+	*(void **)children = *spare;
+	*spare = children;
+}
+
+static TREE *
+new_node(megahal_ctx_t ctx, struct node_pool *pool)
+{
+	TREE *node = NULL;
+
+	/* Allocate memory for the new node */
+	node = (TREE *)pool_alloc(ctx, pool, sizeof(TREE));
+	if (node == NULL) {
+		// TODO: error
+		//error("new_node", "Unable to allocate the node.");
+		return NULL;
+	}
+
+	/* Initialise the contents of the node */
+	node->symbol = 0;
+	node->usage = 0;
+	node->count = 0;
+	node->branch = 0;
+	node->tree = NULL;
+
+	return node;
+}
+
+static void
+load_tree(megahal_ctx_t ctx, struct node_pool *pool, FILE *file, TREE *node, bool wide)
+{
+	register unsigned int i;
+	uint32_t branch;
+	TREE *child;
+
+	node->symbol = load_number(file, sizeof(uint16_t), wide);
+	node->usage = load_number(file, sizeof(uint32_t), wide);
+	node->count = load_number(file, sizeof(uint16_t), wide);
+	branch = load_number(file, sizeof(uint16_t), wide);
+
+	/* Children are saved in order, so each one is appended. */
+	for (i = 0; i < branch; ++i) {
+		child = new_node(ctx, pool);
+		if (child == NULL) {
+			//error("load_tree", "Unable to allocate subtree");
+			// TODO: Error
+			return;
+		}
+
+		load_tree(ctx, pool, file, child, wide);
+		add_node(ctx, pool, node, child, i);
+	}
+}
+
+static struct megahal_swaplist *
+new_swap(megahal_ctx_t ctx)
+{
+	struct megahal_swaplist *list;
+
+	list = af_malloc(ctx, sizeof(*list));
+
+	if (list == NULL) {
+		// error("new_swap", "Unable to allocate swap");
+		// TODO: Error
+		return NULL;
+	}
+
+	list->size = 0;
+	list->from = NULL;
+	list->to = NULL;
+	list->hash = NULL;
+	list->next = NULL;
+	list->slot = NULL;
+	list->bits = 0;
+
+	return list;
+}
+
+/* Grow one of the swap list's arrays to hold size entries. */
+static void *
+grow_swaps(megahal_ctx_t ctx, void *array, size_t entry, uint32_t size)
+{
+	if (array == NULL) {
+		return af_malloc(ctx, entry * size);
+	}
+
+	return af_realloc(ctx, array, entry * size);
+}
+
+static void
+add_swap(megahal_ctx_t ctx, struct megahal_swaplist *list, const char *s, const char *d)
+{
+	uint32_t size = list->size + 1;
+	uint16_t index;
+	void *grown;
+	STRING from;
+	STRING to;
+
+	if (size > UINT16_MAX) {
+		// TODO: Error
+		return;
+	}
+
+	if ((grown = grow_swaps(ctx, list->from, sizeof(STRING), size)) == NULL) {
+		//error("add_swap", "Unable to reallocate from");
+		//TODO: Error
+		return;
+	}
+
+	list->from = (STRING *)grown;
+
+	if ((grown = grow_swaps(ctx, list->to, sizeof(STRING), size)) == NULL) {
+		//error("add_swap", "Unable to reallocate to");
+		//TODO: Error
+		return;
+	}
+
+	list->to = (STRING *)grown;
+
+	if ((grown = grow_swaps(ctx, list->hash, sizeof(uint32_t), size)) == NULL) {
+		//TODO: Error
+		return;
+	}
+
+	list->hash = (uint32_t *)grown;
+
+	if ((grown = grow_swaps(ctx, list->next, sizeof(uint16_t), size)) == NULL) {
+		//TODO: Error
+		return;
+	}
+
+	list->next = (uint16_t *)grown;
+
+	/* Keep the table at most half full. */
+	if ((2 * size) > (1u << list->bits)) {
+		if (!index_swaps(ctx, list, (list->bits == 0) ? 4 : (list->bits + 1))) {
+			//TODO: Error
+			return;
+		}
+	}
+
+	from.length = strlen(s);
+	from.word = af_strdup(ctx, s);
+
+	if (from.word != NULL) {
+		fold_upper(character_table(), from.word, from.word, from.length);
+	}
+
+	to.length = strlen(d);
+	to.word = af_strdup(ctx, d);
+
+	if ((from.word == NULL) || (to.word == NULL)) {
+		//TODO: Error
+		if (from.word != NULL) {
+			af_free(ctx, from.word);
+		}
+
+		if (to.word != NULL) {
+			af_free(ctx, to.word);
+		}
+
+		return;
+	}
+
+	list->from[size - 1] = from;
+	list->to[size - 1] = to;
+	list->hash[size - 1] = hash_word(from);
+	list->next[size - 1] = 0;
+
+	/* Chain the swap after the others from the same word, if there are
+	 * any, or start a chain of its own. */
+	index = find_swap(list, from, list->hash[size - 1]);
+
+	if (index != 0) {
+		while (list->next[index - 1] != 0) {
+			index = list->next[index - 1];
+		}
+
+		list->next[index - 1] = size;
+	} else {
+		insert_swap(list, size - 1);
+	}
+
+	list->size = size;
+}
+
+/* Find the first swap from a word, returning its index plus one, or zero
+ * if there isn't one. */
+static uint16_t
+find_swap(struct megahal_swaplist *list, STRING word, uint32_t hash)
+{
+	uint32_t mask;
+	uint32_t h;
+	uint16_t index;
+
+	if (list->slot == NULL) {
+		return 0;
+	}
+
+	mask = (1u << list->bits) - 1;
+
+	for (h = hash & mask; list->slot[h] != 0; h = (h + 1) & mask) {
+		index = list->slot[h];
+
+		if ((list->hash[index - 1] == hash) && same_word(word, list->from[index - 1])) {
+			return index;
+		}
+	}
+
+	return 0;
+}
+
+static void
+insert_swap(struct megahal_swaplist *list, uint16_t index)
+{
+	uint32_t mask = (1u << list->bits) - 1;
+	uint32_t h;
+
+	for (h = list->hash[index] & mask; list->slot[h] != 0; h = (h + 1) & mask) {
+		;
+	}
+
+	list->slot[h] = index + 1;
+}
+
+/* Rebuild the table with 2^bits slots.  The chains are kept, so only the
+ * first swap from each word needs to go back in. */
+static bool
+index_swaps(megahal_ctx_t ctx, struct megahal_swaplist *list, unsigned int bits)
+{
+	register uint32_t i;
+	uint16_t *slot;
+
+	slot = (uint16_t *)af_malloc(ctx, sizeof(uint16_t) << bits);
+
+	if (slot == NULL) {
+		return false;
+	}
+
+	for (i = 0; i < (1u << bits); ++i) {
+		slot[i] = 0;
+	}
+
+	if (list->slot != NULL) {
+		af_free(ctx, list->slot);
+	}
+
+	list->slot = slot;
+	list->bits = bits;
+
+	for (i = 0; i < list->size; ++i) {
+		if (find_swap(list, list->from[i], list->hash[i]) == 0) {
+			insert_swap(list, i);
+		}
+	}
+
+	return true;
+}
+
+static struct char_table char_table;
+static pthread_once_t char_table_once = PTHREAD_ONCE_INIT;
+
+static void
+build_character_table(void)
+{
+	register unsigned int i;
+
+	char_table.ascii = true;
+
+	for (i = 0; i < 256; ++i) {
+		char_table.class[i] = (isalpha((int)i) ? CHAR_ALPHA : 0) | (isdigit((int)i) ? CHAR_DIGIT : 0) |
+			(isspace((int)i) ? CHAR_SPACE : 0);
+		char_table.upper[i] = (uint8_t)toupper((int)i);
+		char_table.lower[i] = (uint8_t)tolower((int)i);
+
+		if (char_table.upper[i] != (((i >= 'a') && (i <= 'z')) ? (i - 0x20) : i)) {
+			char_table.ascii = false;
+		}
+	}
+
+	for (i = 0x80; i < UTF8_DIRECT; ++i) {
+		char_table.utf8[i] = range_class(i);
+	}
+}
+
+static const struct char_table *
+character_table(void)
+{
+	pthread_once(&char_table_once, build_character_table);
+
+	return &char_table;
+}
+
+/* Classes of the code points from U+0080 up that aren't plain letters, in
+ * order.  Anything not listed is taken to be a letter, which holds for
+ * most scripts and keeps combining marks with the letters they modify.
+ * Ideographs and kana are letters that make words of their own. */
+static const struct char_range utf8_ranges[] = {
+	{ 0x0080, 0x00A9, 0 }, { 0x00AB, 0x00B4, 0 }, { 0x00B6, 0x00B9, 0 },
+	{ 0x00BB, 0x00BF, 0 }, { 0x00D7, 0x00D7, 0 }, { 0x00F7, 0x00F7, 0 },
+	{ 0x037E, 0x037E, 0 }, { 0x0387, 0x0387, 0 }, { 0x055A, 0x055F, 0 },
+	{ 0x0589, 0x058A, 0 }, { 0x05BE, 0x05BE, 0 }, { 0x05C0, 0x05C0, 0 },
+	{ 0x05C3, 0x05C3, 0 }, { 0x05C6, 0x05C6, 0 }, { 0x05F3, 0x05F4, 0 },
+	{ 0x0600, 0x060F, 0 }, { 0x061B, 0x061F, 0 }, { 0x0660, 0x0669, CHAR_DIGIT },
+	{ 0x066A, 0x066D, 0 }, { 0x06D4, 0x06D4, 0 }, { 0x06F0, 0x06F9, CHAR_DIGIT },
+	{ 0x0964, 0x0965, 0 }, { 0x0966, 0x096F, CHAR_DIGIT }, { 0x09E6, 0x09EF, CHAR_DIGIT },
+	{ 0x0A66, 0x0A6F, CHAR_DIGIT }, { 0x0AE6, 0x0AEF, CHAR_DIGIT }, { 0x0B66, 0x0B6F, CHAR_DIGIT },
+	{ 0x0BE6, 0x0BEF, CHAR_DIGIT }, { 0x0C66, 0x0C6F, CHAR_DIGIT }, { 0x0CE6, 0x0CEF, CHAR_DIGIT },
+	{ 0x0D66, 0x0D6F, CHAR_DIGIT }, { 0x0DE6, 0x0DEF, CHAR_DIGIT }, { 0x0E50, 0x0E59, CHAR_DIGIT },
+	{ 0x0E5A, 0x0E5B, 0 }, { 0x0ED0, 0x0ED9, CHAR_DIGIT }, { 0x0F20, 0x0F29, CHAR_DIGIT },
+	{ 0x1040, 0x1049, CHAR_DIGIT }, { 0x17E0, 0x17E9, CHAR_DIGIT }, { 0x1810, 0x1819, CHAR_DIGIT },
+	{ 0x2000, 0x2018, 0 }, { 0x2019, 0x2019, CHAR_QUOTE }, { 0x201A, 0x206F, 0 },
+	{ 0x2070, 0x20CF, 0 }, { 0x2150, 0x218F, 0 }, { 0x2190, 0x2BFF, 0 },
+	{ 0x2E00, 0x2E7F, 0 }, { 0x2E80, 0x2FDF, CHAR_ALPHA | CHAR_SINGLE }, { 0x3000, 0x303F, 0 },
+	{ 0x3040, 0x30FF, CHAR_ALPHA | CHAR_SINGLE }, { 0x3400, 0x4DBF, CHAR_ALPHA | CHAR_SINGLE },
+	{ 0x4E00, 0x9FFF, CHAR_ALPHA | CHAR_SINGLE }, { 0xD800, 0xDFFF, 0 }, { 0xE000, 0xF8FF, 0 },
+	{ 0xF900, 0xFAFF, CHAR_ALPHA | CHAR_SINGLE }, { 0xFE10, 0xFE1F, 0 }, { 0xFE30, 0xFE6F, 0 },
+	{ 0xFF01, 0xFF0F, 0 }, { 0xFF10, 0xFF19, CHAR_DIGIT }, { 0xFF1A, 0xFF20, 0 },
+	{ 0xFF3B, 0xFF40, 0 }, { 0xFF5B, 0xFF65, 0 }, { 0xFFE0, 0xFFFF, 0 },
+	{ 0x1D7CE, 0x1D7FF, CHAR_DIGIT }, { 0x1F000, 0x1FAFF, 0 }, { 0x20000, 0x3FFFF, CHAR_ALPHA | CHAR_SINGLE },
+	{ 0xE0000, 0x10FFFF, 0 }
+};
+
+static uint8_t
+range_class(uint32_t point)
+{
+	uint32_t low = 0;
+	uint32_t high = sizeof(utf8_ranges) / sizeof(utf8_ranges[0]);
+	uint32_t middle;
+
+	while (low < high) {
+		middle = (low + high) / 2;
+
+		if (point < utf8_ranges[middle].first) {
+			high = middle;
+		} else if (point > utf8_ranges[middle].last) {
+			low = middle + 1;
+		} else {
+			return utf8_ranges[middle].class;
+		}
+	}
+
+	return CHAR_ALPHA;
+}
+
+/* The class of the code point at the start of s, and how many bytes it
+ * takes.  ASCII is looked up in the byte table, so it's split the same
+ * way in either mode. */
+static inline uint8_t
+utf8_class(const struct char_table *table, const unsigned char *s, size_t length, size_t *width)
+{
+	uint32_t point;
+	size_t size;
+	size_t i;
+
+	if (s[0] < 0x80) {
+		*width = 1;
+		return table->class[s[0]] | ((s[0] == '\'') ? CHAR_QUOTE : 0);
+	}
+
+	if ((s[0] >= 0xC2) && (s[0] <= 0xDF)) {
+		size = 2;
+		point = s[0] & 0x1F;
+	} else if ((s[0] >= 0xE0) && (s[0] <= 0xEF)) {
+		size = 3;
+		point = s[0] & 0x0F;
+	} else if ((s[0] >= 0xF0) && (s[0] <= 0xF4)) {
+		size = 4;
+		point = s[0] & 0x07;
+	} else {
+		*width = 1;
+		return 0;
+	}
+
+	if (size > length) {
+		*width = 1;
+		return 0;
+	}
+
+	for (i = 1; i < size; ++i) {
+		if ((s[i] & 0xC0) != 0x80) {
+			*width = 1;
+			return 0;
+		}
+
+		point = (point << 6) | (s[i] & 0x3F);
+	}
+
+	*width = size;
+
+	if (point < UTF8_DIRECT) {
+		return table->utf8[point];
+	}
+
+	return range_class(point);
+}
+
+/* Whether a word starts with a letter or digit, as the tokenizer sees
+ * it. */
+static bool
+alnum_word(megahal_ctx_t ctx, STRING word)
+{
+	const struct char_table *table = character_table();
+	size_t width;
+
+	if (word.length == 0) {
+		return false;
+	}
+
+	if (ctx->tokenizer == MEGAHAL_TOKENIZER_UTF8) {
+		return ((utf8_class(table, (const unsigned char *)word.word, word.length, &width) & (CHAR_ALPHA | CHAR_DIGIT)) != 0);
+	}
+
+	return ((table->class[(unsigned char)word.word[0]] & (CHAR_ALPHA | CHAR_DIGIT)) != 0);
+}
+
+#if defined(__AVX2__)
+static inline __m256i
+upper_block(const char *src)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i *)src);
+	__m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('a' - 1)),
+		_mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), v));
+
+	return _mm256_sub_epi8(v, _mm256_and_si256(lower, _mm256_set1_epi8(0x20)));
+}
+
+static inline __m256i
+load_block(const char *src)
+{
+	return _mm256_loadu_si256((const __m256i *)src);
+}
+
+static inline void
+store_block(char *dst, __m256i v)
+{
+	_mm256_storeu_si256((__m256i *)dst, v);
+}
+
+static inline uint32_t
+equal_blocks(__m256i a, __m256i b)
+{
+	return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+}
+#elif defined(__SSE2__)
+static inline __m128i
+upper_block(const char *src)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)src);
+	__m128i lower = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('a' - 1)),
+		_mm_cmplt_epi8(v, _mm_set1_epi8('z' + 1)));
+
+	return _mm_sub_epi8(v, _mm_and_si128(lower, _mm_set1_epi8(0x20)));
+}
+
+static inline __m128i
+load_block(const char *src)
+{
+	return _mm_loadu_si128((const __m128i *)src);
+}
+
+static inline void
+store_block(char *dst, __m128i v)
+{
+	_mm_storeu_si128((__m128i *)dst, v);
+}
+
+static inline uint32_t
+equal_blocks(__m128i a, __m128i b)
+{
+	return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) | 0xffff0000u;
+}
+#endif
+
+/* Copy length bytes of src into dst in upper case. */
+static void
+fold_upper(const struct char_table *table, char *dst, const char *src, size_t length)
+{
+	size_t i = 0;
+
+#if defined(FOLD_WIDTH)
+	if (table->ascii) {
+		for (; (i + FOLD_WIDTH) <= length; i += FOLD_WIDTH) {
+			store_block(dst + i, upper_block(src + i));
+		}
+	}
+#endif
+
+	for (; i < length; ++i) {
+		dst[i] = (char)table->upper[(unsigned char)src[i]];
+	}
+}
+
+/* Whether a word is the same as a key, which is already in upper case.
+ * Keys looked up from another dictionary are folded too, so memcmp()
+ * settles those; otherwise only the word needs folding. */
+static bool
+same_word(STRING word, STRING key)
+{
+	const struct char_table *table = character_table();
+	const unsigned char *a = (const unsigned char *)word.word;
+	const unsigned char *b = (const unsigned char *)key.word;
+	register uint32_t i = 0;
+
+	if (word.length != key.length) {
+		return false;
+	}
+
+	if (memcmp(a, b, word.length) == 0) {
+		return true;
+	}
+
+#if defined(FOLD_WIDTH)
+	if (table->ascii) {
+		for (; (i + FOLD_WIDTH) <= word.length; i += FOLD_WIDTH) {
+			if (equal_blocks(upper_block(word.word + i), load_block(key.word + i)) != UINT32_MAX) {
+				return false;
+			}
+		}
+	}
+#endif
+
+	for (; i < word.length; ++i) {
+		if (table->upper[a[i]] != b[i]) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Whether a word ends before the character at position, given the word
+ * started at start.  Words are runs of letters, of digits or of anything
+ * else, except that an apostrophe between two letters joins them. */
+static inline bool
+boundary(const unsigned char *s, const uint8_t *classes, size_t start, size_t position, size_t length)
+{
+	uint8_t current;
+	uint8_t previous;
+
+	if (position == length) {
+		return true;
+	}
+
+	current = classes[s[position]];
+	previous = classes[s[position - 1]];
+
+	if ((s[position] == '\'') &&
+	    ((previous & CHAR_ALPHA) != 0) &&
+	    ((position + 1) < length) &&
+	    ((classes[s[position + 1]] & CHAR_ALPHA) != 0)) {
+		return false;
+	}
+
+	if (((position - start) > 1) &&
+	    (s[position - 1] == '\'') &&
+	    ((classes[s[position - 2]] & CHAR_ALPHA) != 0) &&
+	    ((current & CHAR_ALPHA) != 0)) {
+		return false;
+	}
+
+	/* A change from letter to non-letter, or digit to non-digit, or the
+	 * other way around. */
+	return (((current ^ previous) & (CHAR_ALPHA | CHAR_DIGIT)) != 0);
+}
+
+static TREE *
+add_symbol(megahal_ctx_t ctx, struct node_pool *pool, TREE *tree, uint32_t symbol)
+{
+	TREE *node = NULL;
+
+	/* Search for the symbol in the subtree of the tree node. */
+	node = find_symbol_add(ctx, pool, tree, symbol);
+
+	/* Increment the symbol counts */
+	if ((node->count < UINT32_MAX) && (tree->usage < UINT32_MAX)) {
+		node->count += 1;
+		tree->usage += 1;
+	}
+
+	return node;
+}
+
+static TREE *
+find_symbol(TREE *node, uint32_t symbol)
+{
+	register unsigned int i;
+	TREE *found = NULL;
+	bool found_symbol = false;
+
+	if (node->branch > FANOUT_HASHED) {
+		return find_hashed(node, symbol);
+	}
+
+	/* Perform a binary search for the symbol. */
+	i = search_node(node, symbol, &found_symbol);
+	if (found_symbol == true) {
+		found = node_child(node, i);
+	}
+
+	return found;
+}
+
+static TREE *
+find_symbol_add(megahal_ctx_t ctx, struct node_pool *pool, TREE *node, uint32_t symbol)
+{
+	register unsigned int i;
+	TREE *found = NULL;
+	bool found_symbol = false;
+
+	/* Perform a binary search for the symbol.  If the symbol isn't found,
+	 * attach a new sub-node to the tree node so that it remains sorted
+	 * (or, for a hashed node, append one and index it). */
+	if (node->branch > FANOUT_HASHED) {
+		found = find_hashed(node, symbol);
+		i = node->branch;
+	} else {
+		i = search_node(node, symbol, &found_symbol);
+
+		if (found_symbol == true) {
+			found = node_child(node, i);
+		}
+	}
+
+	if (found == NULL) {
+		found=new_node(ctx, pool);
+		found->symbol = symbol;
+		add_node(ctx, pool, node, found, i);
+	}
+
+	return found;
+}
+
+static int
+search_node(TREE *node, uint32_t symbol, bool *found_symbol)
 {
 	register unsigned int position;
 	int min;
 	int max;
 	int middle;
-	int compar;
+	uint32_t other;
+
+	/* Handle the special case where the subtree is empty. */
+	if (node->branch == 0) {
+		position = 0;
+		goto notfound;
+	}
+
+	/* Small subtrees are cheaper to scan than to halve. */
+	if (node->branch <= FANOUT_LINEAR) {
+		for (position = 0; position < node->branch; ++position) {
+			other = node_child(node, position)->symbol;
+
+			if (symbol == other) {
+				goto found;
+			} else if (symbol < other) {
+				goto notfound;
+			}
+		}
+
+		goto notfound;
+	}
+
+	/* Perform a binary search on the subtree. */
+	min = 0;
+	max = node->branch - 1;
+	while (true) {
+		middle = (min + max) / 2;
+		other = node->tree[middle]->symbol;
+		if (symbol == other) {
+			position = middle;
+			goto found;
+		} else if (symbol > other) {
+			if (max == middle) {
+				position = middle + 1;
+				goto notfound;
+			}
+			min = middle + 1;
+		} else {
+			if (min == middle) {
+				position = middle;
+				goto notfound;
+			}
+			max = middle - 1;
+		}
+	}
+
+found:
+	*found_symbol = true;
+	return position;
+
+notfound:
+	*found_symbol = false;
+	return position;
+}
+
+static inline uint32_t
+hash_symbol(uint32_t symbol, unsigned int bits)
+{
+	return (symbol * 2654435761u) >> (32 - bits);
+}
+
+static uint32_t *
+child_index(TREE *node, unsigned int *bits)
+{
+	unsigned int class = children_class(node->branch);
+
+	/* The index has twice as many slots as the array has children. */
+	*bits = class + 1;
+
+	return (uint32_t *)(node->tree + (1u << class));
+}
+
+static void
+index_child(TREE *node, unsigned int position)
+{
+	uint32_t *slot;
+	unsigned int bits;
+	uint32_t mask;
+	uint32_t h;
+
+	slot = child_index(node, &bits);
+	mask = (1u << bits) - 1;
+
+	for (h = hash_symbol(node->tree[position]->symbol, bits); slot[h] != SLOT_EMPTY; h = (h + 1) & mask) {
+		;
+	}
+
+	slot[h] = position;
+}
+
+static void
+index_children(TREE *node)
+{
+	register unsigned int i;
+	uint32_t *slot;
+	unsigned int bits;
+
+	slot = child_index(node, &bits);
+
+	for (i = 0; i < (1u << bits); ++i) {
+		slot[i] = SLOT_EMPTY;
+	}
+
+	for (i = 0; i < node->branch; ++i) {
+		index_child(node, i);
+	}
+}
+
+static TREE *
+find_hashed(TREE *node, uint32_t symbol)
+{
+	uint32_t position = hashed_position(node, symbol);
+
+	return (position != SLOT_EMPTY) ? node->tree[position] : NULL;
+}
+
+static uint32_t
+hashed_position(TREE *node, uint32_t symbol)
+{
+	uint32_t *slot;
+	unsigned int bits;
+	uint32_t mask;
+	uint32_t h;
+
+	slot = child_index(node, &bits);
+	mask = (1u << bits) - 1;
+
+	for (h = hash_symbol(symbol, bits); slot[h] != SLOT_EMPTY; h = (h + 1) & mask) {
+		if (node->tree[slot[h]]->symbol == symbol) {
+			return slot[h];
+		}
+	}
+
+	return SLOT_EMPTY;
+}
+
+static int
+compare_children(const void *a, const void *b)
+{
+	uint32_t x = (*(TREE * const *)a)->symbol;
+	uint32_t y = (*(TREE * const *)b)->symbol;
+
+	return (x > y) - (x < y);
+}
+
+static void
+sort_children(TREE *node)
+{
+	/* Hashed children are kept in insertion order; put them back into
+	 * symbol order for anything that needs to walk them sorted. */
+	if (node->branch > FANOUT_HASHED) {
+		qsort(node->tree, node->branch, sizeof(TREE *), compare_children);
+		index_children(node);
+	}
+}
+
+static void
+add_node(megahal_ctx_t ctx, struct node_pool *pool, TREE *tree, TREE *node, int position)
+{
+	register int i;
+	TREE **children;
+	bool grow;
+
+	if (tree->branch == 0) {
+		tree->only = node;
+		tree->branch = 1;
+		return;
+	}
+
+	/* Child arrays have a power-of-two number of slots, so room for one
+	 * more child only has to be made when the array is full (or when the
+	 * inline child is moved out into an array). */
+	grow = ((tree->branch & (tree->branch - 1)) == 0);
+
+	if (grow) {
+		children = new_children(ctx, pool, tree->branch + 1);
+
+		if (children == NULL) {
+			// error("add_node", "Unable to reallocate subtree.");
+			// TODO: Error
+			return;
+		}
+
+		if (tree->branch == 1) {
+			children[0] = tree->only;
+		} else {
+			memcpy(children, tree->tree, sizeof(TREE *) * tree->branch);
+			free_children(pool, tree->tree, tree->branch);
+		}
+
+		tree->tree = children;
+	}
+
+	/* Hashed nodes append, re-indexing whenever the array has moved. */
+	if (tree->branch >= FANOUT_HASHED) {
+		tree->tree[tree->branch] = node;
+		tree->branch += 1;
+
+		if (grow) {
+			index_children(tree);
+		} else {
+			index_child(tree, tree->branch - 1);
+		}
+
+		return;
+	}
+
+	/* Shuffle the nodes down so that we can insert the new node at the
+	 * subtree index given by position. */
+	for (i = tree->branch; i > position; --i) {
+		tree->tree[i] = tree->tree[i - 1];
+	}
+
+	/* Add the new node to the sub-tree. */
+	tree->tree[position] = node;
+	tree->branch += 1;
+}
+
+static inline uint32_t
+ref_branch(const struct frozen_trie *view, NODEREF ref)
+{
+	if (view != NULL) {
+		return view->child[FROZEN_INDEX(ref) + 1] - view->child[FROZEN_INDEX(ref)];
+	}
+
+	return ((TREE *)ref)->branch;
+}
+
+static inline uint32_t
+ref_usage(const struct frozen_trie *view, NODEREF ref)
+{
+	if (view != NULL) {
+		return view->usage[FROZEN_INDEX(ref)];
+	}
+
+	return ((TREE *)ref)->usage;
+}
+
+static inline uint32_t
+frozen_symbol(const struct frozen_trie *trie, uint32_t n)
+{
+	return trie->wide ? ((uint32_t *)trie->symbol)[n] : ((uint16_t *)trie->symbol)[n];
+}
+
+static inline uint32_t
+frozen_count(const struct frozen_trie *trie, uint32_t n)
+{
+	return trie->wide ? ((uint32_t *)trie->count)[n] : ((uint16_t *)trie->count)[n];
+}
+
+static inline uint32_t
+ref_symbol(const struct frozen_trie *view, NODEREF ref)
+{
+	if (view != NULL) {
+		return frozen_symbol(view, FROZEN_INDEX(ref));
+	}
+
+	return ((TREE *)ref)->symbol;
+}
+
+static inline uint32_t
+ref_count(const struct frozen_trie *view, NODEREF ref)
+{
+	if (view != NULL) {
+		return frozen_count(view, FROZEN_INDEX(ref));
+	}
+
+	return ((TREE *)ref)->count;
+}
+
+static inline NODEREF
+ref_child(const struct frozen_trie *view, NODEREF ref, uint32_t i)
+{
+	if (view != NULL) {
+		return FROZEN_REF(view->child[FROZEN_INDEX(ref)] + i);
+	}
+
+	return (NODEREF)node_child((TREE *)ref, i);
+}
+
+static NODEREF
+find_ref(const struct frozen_trie *view, NODEREF ref, uint32_t symbol)
+{
+	uint32_t min;
+	uint32_t max;
+	uint32_t middle;
+	uint32_t other;
+
+	if (view == NULL) {
+		return (NODEREF)find_symbol((TREE *)ref, symbol);
+	}
+
+	/* Binary search the node's range of children. */
+	min = view->child[FROZEN_INDEX(ref)];
+	max = view->child[FROZEN_INDEX(ref) + 1];
+
+	while (min < max) {
+		middle = min + (max - min) / 2;
+		other = frozen_symbol(view, middle);
+
+		if (other == symbol) {
+			return FROZEN_REF(middle);
+		} else if (other < symbol) {
+			min = middle + 1;
+		} else {
+			max = middle;
+		}
+	}
+
+	return 0;
+}
+
+/* Where the child with the given symbol sits among a node's children, in
+ * the order ref_child() numbers them. */
+static bool
+ref_position(const struct frozen_trie *view, NODEREF ref, uint32_t symbol, uint32_t *position)
+{
+	NODEREF child;
+	bool found = false;
+
+	if (view != NULL) {
+		child = find_ref(view, ref, symbol);
+
+		if (child != 0) {
+			*position = FROZEN_INDEX(child) - view->child[FROZEN_INDEX(ref)];
+		}
+
+		return (child != 0);
+	}
+
+	if (((TREE *)ref)->branch > FANOUT_HASHED) {
+		*position = hashed_position((TREE *)ref, symbol);
+		return (*position != SLOT_EMPTY);
+	}
+
+	*position = search_node((TREE *)ref, symbol, &found);
+
+	return found;
+}
+
+/* Symbols and counts are stored 16 bits wide unless the model has
+ * outgrown them. */
+static size_t
+frozen_bytes(uint32_t size, bool wide)
+{
+	return (sizeof(uint32_t) * (3 * (size_t)size + 1)) + ((wide ? sizeof(uint32_t) : sizeof(uint16_t)) * (2 * (size_t)size));
+}
+
+static void
+layout_frozen(struct frozen_trie *trie, void *block, uint32_t size, bool wide)
+{
+	size_t width = wide ? sizeof(uint32_t) : sizeof(uint16_t);
+
+	trie->size = size;
+	trie->wide = wide;
+	trie->block = NULL;
+	trie->child = (uint32_t *)block;
+	trie->usage = trie->child + size + 1;
+	trie->cumulative = trie->usage + size;
+	trie->symbol = trie->cumulative + size;
+	trie->count = (char *)trie->symbol + (width * size);
+}
+
+/* Check that a frozen trie read from a file is laid out the way
+ * freeze_tree() writes one, so walking it can't leave the trie or name a
+ * word past the end of the dictionary. */
+static bool
+check_frozen(const struct frozen_trie *trie, uint32_t words)
+{
+	register unsigned int i;
+	uint32_t symbol;
+
+	if ((trie->child[0] != 1) || (trie->child[trie->size] != trie->size)) {
+		return false;
+	}
+
+	for (i = 0; i < trie->size; ++i) {
+		if ((trie->child[i] <= i) || (trie->child[i] > trie->child[i + 1])) {
+			return false;
+		}
+
+		symbol = trie->wide ? ((const uint32_t *)trie->symbol)[i] : ((const uint16_t *)trie->symbol)[i];
+
+		if (symbol >= words) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static uint32_t
+count_nodes(TREE *node)
+{
+	register unsigned int i;
+	uint32_t size = 1;
+
+	for (i = 0; i < node->branch; ++i) {
+		size += count_nodes(node_child(node, i));
+	}
+
+	return size;
+}
+
+static bool
+freeze_tree(megahal_ctx_t ctx, TREE *root, struct frozen_trie *trie, bool wide)
+{
+	register unsigned int i;
+	uint32_t size = count_nodes(root);
+	uint32_t head;
+	uint32_t tail;
+	uint64_t total;
+	TREE **queue;
+	TREE *node;
+	char *block;
+
+	block = af_malloc(ctx, frozen_bytes(size, wide));
+	queue = (TREE **)af_malloc(ctx, sizeof(TREE *) * size);
+
+	if ((block == NULL) || (queue == NULL)) {
+		// TODO: Error
+		if (block != NULL) {
+			af_free(ctx, block);
+		}
+
+		if (queue != NULL) {
+			af_free(ctx, queue);
+		}
+
+		return false;
+	}
+
+	layout_frozen(trie, block, size, wide);
+	trie->block = block;
+
+	/* Walk the tree breadth-first, using the queue of visited nodes to
+	 * find each frozen node's children in turn. */
+	queue[0] = root;
+	trie->cumulative[0] = 0;
+	tail = 1;
+
+	for (head = 0; head < size; ++head) {
+		node = queue[head];
+
+		trie->child[head] = tail;
+		trie->usage[head] = node->usage;
+		if (wide) {
+			((uint32_t *)trie->symbol)[head] = node->symbol;
+			((uint32_t *)trie->count)[head] = node->count;
+		} else {
+			((uint16_t *)trie->symbol)[head] = (uint16_t)node->symbol;
+			((uint16_t *)trie->count)[head] = (uint16_t)node->count;
+		}
+
+		sort_children(node);
+
+		total = 0;
+		for (i = 0; i < node->branch; ++i) {
+			total += node_child(node, i)->count;
+			trie->cumulative[tail] = (uint32_t)MIN(total, UINT32_MAX);
+			queue[tail++] = node_child(node, i);
+		}
+	}
+
+	trie->child[size] = tail;
+
+	af_free(ctx, queue);
+
+	return true;
+}
+
+static struct snapshot *
+freeze_model(megahal_ctx_t ctx, struct megahal_model *model)
+{
+	struct snapshot *snapshot;
+
+	sync_model(model);
+
+	snapshot = af_malloc(ctx, sizeof(*snapshot));
+
+	if (snapshot == NULL) {
+		// TODO: Error
+		return NULL;
+	}
+
+	snapshot->forward.block = NULL;
+	snapshot->backward.block = NULL;
+	snapshot->dictionary = NULL;
+	snapshot->refs = 0;
+
+	if (!freeze_tree(ctx, model->forward, &snapshot->forward, model->wide) ||
+	    !freeze_tree(ctx, model->backward, &snapshot->backward, model->wide)) {
+		free_snapshot(ctx, snapshot);
+		return NULL;
+	}
+
+	return snapshot;
+}
+
+static void
+free_snapshot(megahal_ctx_t ctx, struct snapshot *snapshot)
+{
+	if (snapshot == NULL) {
+		return;
+	}
+
+	if (snapshot->forward.block != NULL) {
+		af_free(ctx, snapshot->forward.block);
+	}
+
+	if (snapshot->backward.block != NULL) {
+		af_free(ctx, snapshot->backward.block);
+	}
+
+	/* The copied dictionary only borrows its words. */
+	if (snapshot->dictionary != NULL) {
+		free_dictionary(ctx, snapshot->dictionary);
+		af_free(ctx, snapshot->dictionary);
+	}
+
+	af_free(ctx, snapshot);
+}
+
+/* Copy a dictionary's arrays, borrowing its words.  The model never frees
+ * or moves a word while it lives, so the copy stays valid after the
+ * model's own arrays have grown. */
+static struct megahal_dict *
+copy_dictionary(megahal_ctx_t ctx, struct megahal_dict *dictionary)
+{
+	struct megahal_dict *copy;
+
+	copy = new_dictionary(ctx);
+
+	if (copy == NULL) {
+		return NULL;
+	}
+
+	if (dictionary->size == 0) {
+		return copy;
+	}
+
+	copy->entry = (STRING *)af_malloc(ctx, sizeof(STRING) * dictionary->size);
+	copy->hash = (uint32_t *)af_malloc(ctx, sizeof(uint32_t) * dictionary->size);
+	copy->table = (uint32_t *)af_malloc(ctx, sizeof(uint32_t) * (dictionary->mask + 1));
+
+	if ((copy->entry == NULL) || (copy->hash == NULL) || (copy->table == NULL)) {
+		free_dictionary(ctx, copy);
+		af_free(ctx, copy);
+		return NULL;
+	}
+
+	memcpy(copy->entry, dictionary->entry, sizeof(STRING) * dictionary->size);
+	memcpy(copy->hash, dictionary->hash, sizeof(uint32_t) * dictionary->size);
+	memcpy(copy->table, dictionary->table, sizeof(uint32_t) * (dictionary->mask + 1));
+
+	copy->size = dictionary->size;
+	copy->capacity = dictionary->size;
+	copy->borrowed = dictionary->size;
+	copy->mask = dictionary->mask;
+
+	return copy;
+}
+
+/* Freeze the model with a copy of its dictionary and make that the
+ * snapshot replies are generated from.  Replies still using the previous
+ * snapshot keep it until they finish. */
+static bool
+publish_model(megahal_ctx_t ctx, struct megahal_model *model)
+{
+	struct publisher *publisher = &model->publisher;
+	struct snapshot *snapshot;
+	struct snapshot *old;
+
+	if (!thaw_model(ctx, model)) {
+		return false;
+	}
+
+	learn_deferred(ctx, model);
+	snapshot = freeze_model(ctx, model);
+
+	if (snapshot == NULL) {
+		return false;
+	}
+
+	snapshot->dictionary = copy_dictionary(ctx, model->dictionary);
+
+	if (snapshot->dictionary == NULL) {
+		// TODO: Error
+		free_snapshot(ctx, snapshot);
+		return false;
+	}
+
+	/* The publisher holds a reference of its own. */
+	snapshot->refs = 1;
+
+	pthread_mutex_lock(&publisher->lock);
+	old = publisher->current;
+	publisher->current = snapshot;
+	pthread_mutex_unlock(&publisher->lock);
+
+	release_snapshot(ctx, model, old);
+
+	publisher->pending = 0;
+	clock_gettime(CLOCK_MONOTONIC, &publisher->last);
+
+	return true;
+}
+
+static void
+stop_publishing(megahal_ctx_t ctx, struct megahal_model *model)
+{
+	struct publisher *publisher = &model->publisher;
+	struct snapshot *old;
+
+	pthread_mutex_lock(&publisher->lock);
+	old = publisher->current;
+	publisher->current = NULL;
+	pthread_mutex_unlock(&publisher->lock);
+
+	release_snapshot(ctx, model, old);
+}
+
+static struct snapshot *
+acquire_snapshot(struct megahal_model *model)
+{
+	struct publisher *publisher = &model->publisher;
+	struct snapshot *snapshot;
+
+	pthread_mutex_lock(&publisher->lock);
+	snapshot = publisher->current;
+
+	if (snapshot != NULL) {
+		++snapshot->refs;
+	}
+
+	pthread_mutex_unlock(&publisher->lock);
+
+	return snapshot;
+}
+
+static void
+release_snapshot(megahal_ctx_t ctx, struct megahal_model *model, struct snapshot *snapshot)
+{
+	uint32_t refs;
+
+	if (snapshot == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&model->publisher.lock);
+	refs = --snapshot->refs;
+	pthread_mutex_unlock(&model->publisher.lock);
+
+	if (refs == 0) {
+		free_snapshot(ctx, snapshot);
+	}
+}
+
+static bool
+thaw_tree(megahal_ctx_t ctx, struct node_pool *pool, const struct frozen_trie *trie, uint32_t n, TREE *node)
+{
+	register unsigned int i;
+	uint32_t branch = trie->child[n + 1] - trie->child[n];
+	TREE *child;
+
+	node->symbol = frozen_symbol(trie, n);
+	node->usage = trie->usage[n];
+	node->count = frozen_count(trie, n);
+
+	for (i = 0; i < branch; ++i) {
+		child = new_node(ctx, pool);
+
+		if (child == NULL) {
+			// TODO: Error
+			return false;
+		}
+
+		if (!thaw_tree(ctx, pool, trie, trie->child[n] + i, child)) {
+			return false;
+		}
+
+		add_node(ctx, pool, node, child, i);
+	}
+
+	return true;
+}
+
+static bool
+thaw_model(megahal_ctx_t ctx, struct megahal_model *model)
+{
+	/* A mapped model has no live tries until something needs to change
+	 * them, at which point they are rebuilt from its snapshot. */
+	if (model->live) {
+		return true;
+	}
+
+	if (!thaw_tree(ctx, &model->learner[FORWARD].nodes, &model->frozen->forward, 0, model->forward) ||
+	    !thaw_tree(ctx, &model->learner[BACKWARD].nodes, &model->frozen->backward, 0, model->backward)) {
+		return false;
+	}
+
+	model->live = true;
+
+	return true;
+}
+
+static size_t
+mapped_align(size_t offset)
+{
+	return (offset + MAPPED_ALIGN - 1) & ~(size_t)(MAPPED_ALIGN - 1);
+}
+
+static bool
+load_mapped(megahal_ctx_t ctx, const char *filename, struct megahal_model *model)
+{
+	register unsigned int i;
+	struct mapped_header header;
+	struct megahal_dict *dictionary = model->dictionary;
+	struct snapshot *snapshot = NULL;
+	struct stat st;
+	const uint32_t *offset;
+	const uint32_t *hash;
+	STRING word;
+	char *text;
+	char *base;
+	bool wide;
+	bool rehash;
+	size_t forward;
+	size_t backward;
+	size_t words;
+	size_t end;
+	void *map;
+	int fd;
+
+	if (filename == NULL) {
+		return false;
+	}
+
+	fd = open(filename, O_RDONLY);
+
+	if (fd < 0) {
+		// TODO: warn
+		return false;
+	}
+
+	if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(header))) {
+		close(fd);
+		return false;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		// TODO: warn
+		return false;
+	}
+
+	base = map;
+	memcpy(&header, base, sizeof(header));
+
+	if ((memcmp(header.cookie, MAPPED_COOKIE, sizeof(header.cookie)) != 0) ||
+	    (header.version != MAPPED_VERSION) || (header.order != model->order) ||
+	    (header.wide > 1) || (header.ascii > 1) || (header.forward == 0) || (header.backward == 0) ||
+	    (header.words < 2)) {
+		// TODO: warn
+		//warn("load_mapped", "File `%s' is not a mapped MegaHAL brain", filename);
+		goto fail;
+	}
+
+	forward = mapped_align(sizeof(header));
+	backward = mapped_align(forward + frozen_bytes(header.forward, header.wide));
+	words = mapped_align(backward + frozen_bytes(header.backward, header.wide));
+	end = words + (sizeof(uint32_t) * ((size_t)header.words * 2 + 1)) + header.text;
+
+	if ((size_t)st.st_size < end) {
+		goto fail;
+	}
+
+	snapshot = af_malloc(ctx, sizeof(*snapshot));
+
+	if (snapshot == NULL) {
+		goto fail;
+	}
+
+	snapshot->dictionary = NULL;
+	snapshot->refs = 0;
+	layout_frozen(&snapshot->forward, base + forward, header.forward, header.wide);
+	layout_frozen(&snapshot->backward, base + backward, header.backward, header.wide);
+
+	if (!check_frozen(&snapshot->forward, header.words) || !check_frozen(&snapshot->backward, header.words)) {
+		goto fail;
+	}
+
+	offset = (const uint32_t *)(base + words);
+	hash = offset + header.words + 1;
+	text = (char *)(hash + header.words);
+
+	/* The dictionary's words are used as they were saved, and so are its
+	 * hashes unless either locale upper-cases beyond ASCII.  Reused
+	 * hashes are spot checked so that a corrupt column is caught. */
+	free_words(ctx, dictionary);
+	free_dictionary(ctx, dictionary);
+	wide = header.wide;
+	rehash = !header.ascii || !character_table()->ascii;
+
+	for (i = 0; i < header.words; ++i) {
+		if ((offset[i] > offset[i + 1]) || (offset[i + 1] > header.text)) {
+			goto fail_dictionary;
+		}
+
+		word.length = offset[i + 1] - offset[i];
+		word.word = text + offset[i];
+
+		if (!rehash && (i < MAPPED_CHECKED) && (hash[i] != hash_word(word))) {
+			goto fail_dictionary;
+		}
+
+		if (append_word(ctx, dictionary, word, rehash ? hash_word(word) : hash[i]) != i) {
+			goto fail_dictionary;
+		}
+
+		if (word.length > UINT8_MAX) {
+			wide = true;
+		}
+	}
+
+	dictionary->borrowed = header.words;
+
+	model->frozen = snapshot;
+	model->map = map;
+	model->map_size = st.st_size;
+	model->live = false;
+	model->wide = wide;
+
+	return true;
+
+fail_dictionary:
+	free_dictionary(ctx, dictionary);
+
+fail:
+	if (snapshot != NULL) {
+		af_free(ctx, snapshot);
+	}
+
+	munmap(map, st.st_size);
+
+	return false;
+}
+
+static void
+write_padding(struct writer *writer)
+{
+	static const char zero[MAPPED_ALIGN] = { 0 };
+
+	writer_put(writer, zero, mapped_align(writer->bytes) - writer->bytes);
+}
+
+static void
+write_frozen(struct writer *writer, const struct frozen_trie *trie)
+{
+	size_t width = trie->wide ? sizeof(uint32_t) : sizeof(uint16_t);
+
+	writer_put(writer, trie->child, sizeof(uint32_t) * ((size_t)trie->size + 1));
+	writer_put(writer, trie->usage, sizeof(uint32_t) * (size_t)trie->size);
+	writer_put(writer, trie->cumulative, sizeof(uint32_t) * (size_t)trie->size);
+	writer_put(writer, trie->symbol, width * (size_t)trie->size);
+	writer_put(writer, trie->count, width * (size_t)trie->size);
+	write_padding(writer);
+}
+
+static bool
+save_mapped(megahal_ctx_t ctx, const char *filename, struct megahal_model *model)
+{
+	register unsigned int i;
+	struct mapped_header header;
+	struct megahal_dict *dictionary = model->dictionary;
+	struct snapshot *snapshot;
+	struct writer writer;
+	uint32_t *offset;
+	bool ok;
+
+	/* Unless the model is still exactly its mapped snapshot, write out a
+	 * fresh snapshot of the live tries. */
+	snapshot = model->live ? freeze_model(ctx, model) : model->frozen;
+
+	if (snapshot == NULL) {
+		return false;
+	}
+
+	offset = (uint32_t *)af_malloc(ctx, sizeof(uint32_t) * (dictionary->size + 1));
+
+	if (offset == NULL) {
+		ok = false;
+		goto done;
+	}
+
+	offset[0] = 0;
+	for (i = 0; i < dictionary->size; ++i) {
+		offset[i + 1] = offset[i] + dictionary->entry[i].length;
+	}
+
+	if (!writer_open(ctx, &writer, filename)) {
+		//warn("save_mapped", "Unable to open file `%s'", filename);
+		ok = false;
+		goto done;
+	}
+
+	memcpy(header.cookie, MAPPED_COOKIE, sizeof(header.cookie));
+	header.version = MAPPED_VERSION;
+	header.order = model->order;
+	header.wide = snapshot->forward.wide;
+	header.forward = snapshot->forward.size;
+	header.backward = snapshot->backward.size;
+	header.words = dictionary->size;
+	header.text = offset[dictionary->size];
+	header.ascii = character_table()->ascii;
+
+	writer_put(&writer, &header, sizeof(header));
+	write_padding(&writer);
+	write_frozen(&writer, &snapshot->forward);
+	write_frozen(&writer, &snapshot->backward);
+
+	writer_put(&writer, offset, sizeof(uint32_t) * ((size_t)dictionary->size + 1));
+	writer_put(&writer, dictionary->hash, sizeof(uint32_t) * (size_t)dictionary->size);
+
+	for (i = 0; i < dictionary->size; ++i) {
+		writer_put(&writer, dictionary->entry[i].word, dictionary->entry[i].length);
+	}
+
+	ok = writer_commit(ctx, &writer);
+
+done:
+	if (offset != NULL) {
+		af_free(ctx, offset);
+	}
+
+	if (snapshot != model->frozen) {
+		free_snapshot(ctx, snapshot);
+	}
+
+	return ok;
+}
+
+static void
+generate_reply(megahal_ctx_t ctx, megahal_personality_t pers, struct megahal_genstate *state,
+	const struct snapshot *snapshot, char *outstr, size_t outlen, const megahal_reply_opts_t *opts,
+	megahal_reply_stats_t *stats)
+{
+	register unsigned int i;
+	struct search search[MAX_SEARCHES];
+	struct generator extra[MAX_SEARCHES];
+	pthread_t thread[MAX_SEARCHES];
+	bool started[MAX_SEARCHES];
+	bool ready[MAX_SEARCHES];
+	struct megahal_dict *words = state->words;
+	struct megahal_dict *keywords = state->keywords;
+	struct timespec start;
+	uint32_t *input;
+	uint32_t max_candidates = 0;
+	double budget = TIMEOUT;
+	unsigned int threads = 1;
+	unsigned int best;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* Without a budget of either kind, fall back to the default time. */
+	if ((opts != NULL) && ((opts->max_candidates > 0) || (opts->time_budget_us > 0))) {
+		max_candidates = opts->max_candidates;
+		budget = (double)opts->time_budget_us / 1e6;
+	}
+
+	if ((opts != NULL) && (opts->threads > 1)) {
+		threads = MIN(opts->threads, MAX_SEARCHES);
+	}
+
+	/* Every search needs at least one candidate of its own. */
+	if (max_candidates > 0) {
+		threads = MIN(threads, max_candidates);
+	}
+
+	/* Create an array of keywords from the words in the user's input */
+	ready[0] = prepare_generator(ctx, &state->gen, pers, snapshot);
+	make_keywords(ctx, pers, state->gen.dictionary, words, keywords);
+
+	/* Look up the input once, so that candidates can be compared to it
+	 * symbol by symbol. */
+	if (state->input_capacity < words->size) {
+		if (state->input == NULL) {
+			input = (uint32_t *)af_malloc(ctx, sizeof(uint32_t) * words->size);
+		} else {
+			input = (uint32_t *)af_realloc(ctx, state->input, sizeof(uint32_t) * words->size);
+		}
+
+		if (input == NULL) {
+			// TODO: Error
+			ready[0] = false;
+		} else {
+			state->input = input;
+			state->input_capacity = words->size;
+		}
+	}
+
+	if (ready[0]) {
+		for (i = 0; i < words->size; ++i) {
+			state->input[i] = find_word(state->gen.dictionary, words->entry[i]);
+		}
+	}
+
+	strcpy(outstr, "I don't know enough to answer you yet!");
+
+	if (ready[0] && set_keywords(ctx, &state->gen, NULL)) {
+		reply(ctx, &state->gen);
+
+		if (dissimilar(state->input, words->size, &state->gen) == true) {
+			make_output(&state->gen, outstr, outlen);
+		}
+	}
+
+	/* The first search runs on the state's own generator and scratch, and
+	 * any others get generators seeded from it and an even share of the
+	 * candidates.  A lone search writes straight into the output. */
+	for (i = 0; i < threads; ++i) {
+		search[i].ctx = ctx;
+		search[i].input = state->input;
+		search[i].input_size = words->size;
+		search[i].start = &start;
+		search[i].budget = budget;
+		search[i].max_candidates = (max_candidates == 0) ? 0 : (max_candidates / threads) + (i < (max_candidates % threads));
+		search[i].count = 0;
+		search[i].duplicates = 0;
+		search[i].surprise = (float)-1.0;
+		search[i].outlen = outlen;
+		search[i].output = (threads == 1) ? outstr : (char *)af_malloc(ctx, outlen);
+
+		if (i == 0) {
+			search[i].gen = &state->gen;
+		} else {
+			init_generator(&extra[i], (uint64_t)nrand48(state->gen.rng));
+			search[i].gen = &extra[i];
+			ready[i] = prepare_generator(ctx, &extra[i], pers, snapshot);
+		}
+
+		ready[i] = ready[i] && set_keywords(ctx, search[i].gen, keywords);
+
+		if (ready[i]) {
+			forget_replies(search[i].gen);
+		}
+
+		if ((search[i].output == NULL) || !ready[i]) {
+			// TODO: Error
+			threads = i + 1;
+			break;
+		}
+
+		if (threads > 1) {
+			search[i].output[0] = '\0';
+		}
+	}
+
+	/* Loop until the budget runs out, generating and evaluating replies,
+	 * on as many threads as were asked for. */
+	for (i = 0; i < threads; ++i) {
+		started[i] = false;
+
+		if ((search[i].output == NULL) || !ready[i]) {
+			continue;
+		}
+
+		if (threads > 1) {
+			started[i] = (pthread_create(&thread[i], NULL, search_replies, &search[i]) == 0);
+		}
+
+		if (!started[i]) {
+			search_replies(&search[i]);
+		}
+	}
+
+	best = 0;
+
+	for (i = 0; i < threads; ++i) {
+		if (started[i]) {
+			pthread_join(thread[i], NULL);
+		}
+
+		if (search[i].surprise > search[best].surprise) {
+			best = i;
+		}
+	}
+
+	if ((threads > 1) && (search[best].surprise > (float)-1.0)) {
+		strcpy(outstr, search[best].output);
+	}
+
+	if (stats != NULL) {
+		stats->candidates = 0;
+		stats->duplicates = 0;
+		stats->seconds = elapsed_seconds(&start);
+		stats->surprise = search[best].surprise;
+
+		for (i = 0; i < threads; ++i) {
+			stats->candidates += search[i].count;
+			stats->duplicates += search[i].duplicates;
+		}
+
+		stats->duplicate_ratio = (stats->candidates > 0) ? ((double)stats->duplicates / (double)stats->candidates) : 0.0;
+	}
+
+	for (i = 0; i < threads; ++i) {
+		if ((threads > 1) && (search[i].output != NULL)) {
+			af_free(ctx, search[i].output);
+		}
+
+		if (i == 0) {
+			continue;
+		}
+
+		free_generator(ctx, &extra[i]);
+	}
+}
+
+static void *
+search_replies(void *arg)
+{
+	struct search *search = (struct search *)arg;
+	float surprise;
+
+	do {
+		reply(search->ctx, search->gen);
+		++search->count;
+
+		/* A reply that has come up before scored the same then. */
+		if (seen_reply(search->ctx, search->gen)) {
+			++search->duplicates;
+			continue;
+		}
+
+		surprise = evaluate_reply(search->gen);
+		if ((surprise > search->surprise) && (dissimilar(search->input, search->input_size, search->gen) == true)) {
+			search->surprise = surprise;
+			make_output(search->gen, search->output, search->outlen);
+		}
+	} while (((search->max_candidates == 0) || (search->count < search->max_candidates)) &&
+	         ((search->budget <= 0.0) || (elapsed_seconds(search->start) < search->budget)));
+
+	return NULL;
+}
+
+static void
+make_keywords(megahal_ctx_t ctx, megahal_personality_t pers, struct megahal_dict *dictionary,
+	struct megahal_dict *words, struct megahal_dict *keys)
+{
+	struct megahal_swaplist *swp = pers->swap;
+	register unsigned int i;
+	uint16_t j;
+
+	clear_dictionary(ctx, keys);
+
+	for (i = 0; i < words->size; ++i) {
+		/* Find the symbol ID of the word.  If it doesn't exist in the
+		 * model, or if it begins with a non-alphanumeric character, or if
+		 * it is in the exclusion array, then skip over it.  A word with
+		 * swaps is replaced by all of them. */
+		j = find_swap(swp, words->entry[i], hash_word(words->entry[i]));
+
+		if (j == 0) {
+			add_key(ctx, pers, dictionary, keys, words->entry[i]);
+		}
+
+		for (; j != 0; j = swp->next[j - 1]) {
+			add_key(ctx, pers, dictionary, keys, swp->to[j - 1]);
+		}
+	}
+
+	if (keys->size > 0) {
+		for (i = 0; i < words->size; ++i) {
+			j = find_swap(swp, words->entry[i], hash_word(words->entry[i]));
+
+			if (j == 0) {
+				add_aux(ctx, pers, dictionary, keys, words->entry[i]);
+			}
+
+			for (; j != 0; j = swp->next[j - 1]) {
+				add_aux(ctx, pers, dictionary, keys, swp->to[j - 1]);
+			}
+		}
+	}
+}
+
+/* The input is given as symbols in the generator's dictionary, with
+ * zero for words it doesn't know, which no reply can contain. */
+static bool
+dissimilar(const uint32_t *input, uint32_t size, struct generator *gen)
+{
+	if (size != gen->reply_size) {
+		return true;
+	}
+
+	if (size == 0) {
+		return false;
+	}
+
+	return (memcmp(input, gen->reply + gen->reply_head, sizeof(uint32_t) * size) != 0);
+}
+
+static void
+make_output(struct generator *gen, char *outstr, size_t outlen)
+{
+	const uint32_t *reply = gen->reply + gen->reply_head;
+	STRING word;
+	register unsigned int i;
+	register uint32_t j;
+	size_t length;
+
+	if (gen->reply_size == 0) {
+		strcpy(outstr, "I am utterly speechless!");
+		return;
+	}
+
+	length = 1;
+	for (i = 0; i < gen->reply_size; ++i) {
+		length += gen->dictionary->entry[reply[i]].length;
+	}
+
+	if (outlen <= length) {
+		printf("ERRROR!\n");
+		abort();
+		return;
+	}
+
+#if 0
+	output = (char *)realloc(output, sizeof(char) * length);
+
+	if (output == NULL) {
+		//error("make_output", "Unable to reallocate output.");
+		//TODO: Error
+		if (output_none != NULL) {
+			strcpy(output_none, "I forgot what I was going to say!");
+		}
 
-	/* Handle the special case where the subtree is empty. */
-	if (node->branch == 0) {
-		position = 0;
-		goto notfound;
+		return output_none;
 	}
+#endif
 
-	/* Perform a binary search on the subtree. */
-	min = 0;
-	max = node->branch - 1;
-	while (true) {
-		middle = (min + max) / 2;
-		compar = symbol-node->tree[middle]->symbol;
-		if (compar == 0) {
-			position = middle;
-			goto found;
-		} else if (compar > 0) {
-			if (max == middle) {
-				position = middle + 1;
-				goto notfound;
-			}
-			min = middle + 1;
+	length = 0;
+
+	for (i = 0; i < gen->reply_size; ++i) {
+		word = gen->dictionary->entry[reply[i]];
+
+		for (j = 0; j < word.length; ++j) {
+			outstr[length++] = word.word[j];
+		}
+	}
+
+	outstr[length] = '\0';
+}
+
+/* Score the symbol as reply() extends the context with it, keeping its
+ * term for evaluate_reply(). */
+static bool
+keep_term(megahal_ctx_t ctx, struct generator *gen, uint32_t symbol)
+{
+	uint32_t capacity;
+	float *terms;
+	float term;
+	int scored;
+
+	scored = score_context(gen, symbol, &term);
+
+	if (scored < 0) {
+		return true;
+	}
+
+	gen->scored += 1;
+
+	if (scored == 0) {
+		return true;
+	}
+
+	if (gen->terms_size == gen->terms_capacity) {
+		capacity = (gen->terms_capacity == 0) ? 16 : (gen->terms_capacity * 2);
+
+		if (gen->terms == NULL) {
+			terms = (float *)af_malloc(ctx, sizeof(float) * capacity);
 		} else {
-			if (min == middle) {
-				position = middle;
-				goto notfound;
-			}
-			max = middle - 1;
+			terms = (float *)af_realloc(ctx, gen->terms, sizeof(float) * capacity);
+		}
+
+		if (terms == NULL) {
+			return false;
 		}
+
+		gen->terms = terms;
+		gen->terms_capacity = capacity;
 	}
 
-found:
-	*found_symbol = true;
-	return position;
+	gen->terms[gen->terms_size++] = term;
 
-notfound:
-	*found_symbol = false;
-	return position;
+	return true;
+}
+
+/* Work out how surprising the reply is: the keywords in it are scored by
+ * walking it forwards through one trie and backwards through the other.
+ * reply() has already scored the keywords whose context while generating
+ * is the one they have in the finished reply, so only the rest are walked
+ * here.  That's the backward half and the first few forward symbols on the
+ * forward walk, and the forward half on the backward walk.  The terms are
+ * totalled in the order a full walk would find them, so the surprise is
+ * exactly the same. */
+static float
+evaluate_reply(struct generator *gen)
+{
+	const uint32_t *reply = gen->reply + gen->reply_head;
+	uint32_t backward = gen->reply_size - gen->reply_forward;
+	uint32_t rescored = backward + MIN(gen->reply_forward, gen->model->order);
+	register unsigned int i;
+	register int k;
+	float entropy = 0.0f;
+	float term;
+	int scored;
+	int num = gen->scored;
+
+	if ((gen->reply_size == 0) || (gen->keys.preferred == 0)) {
+		return 0.0f;
+	}
+
+	initialize_cursor(gen, true);
+
+	for (i = 0; i < rescored; ++i) {
+		scored = score_context(gen, reply[i], &term);
+
+		if (scored >= 0) {
+			++num;
+		}
+
+		if (scored > 0) {
+			entropy -= term;
+		}
+	}
+
+	for (i = 0; i < gen->forward_terms; ++i) {
+		entropy -= gen->terms[i];
+	}
+
+	initialize_cursor(gen, false);
+
+	for (k = gen->reply_size - 1; k >= (int)backward; --k) {
+		scored = score_context(gen, reply[k], &term);
+
+		if (scored >= 0) {
+			++num;
+		}
+
+		if (scored > 0) {
+			entropy -= term;
+		}
+	}
+
+	for (i = gen->forward_terms; i < gen->terms_size; ++i) {
+		entropy -= gen->terms[i];
+	}
+
+	if (num >= 8) {
+		entropy /= (float)sqrt(num - 1);
+	}
+
+	if (num>=16) {
+		entropy /= (float)num;
+	}
+
+	return entropy;
 }
 
 static void
-add_node(megahal_ctx_t ctx, TREE *tree, TREE *node, int position)
+reply(megahal_ctx_t ctx, struct generator *gen)
 {
+	struct megahal_model *model = gen->model;
 	register int i;
+	uint32_t symbol;
+	bool start = true;
+	bool scoring = (gen->keys.preferred > 0);
 
-	/* Allocate room for one more child node, which may mean allocating
-	 * the sub-tree from scratch. */
-	if (tree->tree == NULL) {
-		tree->tree = (TREE **)af_malloc(ctx, sizeof(TREE *) * (tree->branch + 1));
-	} else {
-		tree->tree = (TREE **)af_realloc(ctx, (TREE **)(tree->tree), sizeof(TREE *) * (tree->branch + 1));
+	gen->reply_head = gen->reply_capacity / 2;
+	gen->reply_size = 0;
+	gen->reply_forward = 0;
+	gen->terms_size = 0;
+	gen->forward_terms = 0;
+	gen->scored = 0;
+
+	for (i = 0; i < (int)gen->keys.size; ++i) {
+		gen->keys.keyword[i].used = false;
 	}
 
-	if (tree->tree == NULL) {
-		// error("add_node", "Unable to reallocate subtree.");
-		// TODO: Error
-		return;
+	/* Start off by making sure that the model's context is empty. */
+	initialize_cursor(gen, true);
+	gen->used_key = false;
+
+	/* Generate the reply in the forward direction. */
+	while (1) {
+		/* Get a random symbol from the current context. */
+		if (start == true) {
+			symbol = seed(gen);
+		} else {
+			symbol = babble(gen);
+		}
+
+		if ((symbol == 0) || (symbol == 1)) {
+			break;
+		}
+
+		start = false;
+
+		/* Append the symbol to the reply. */
+		if (!push_symbol(ctx, gen, symbol, false)) {
+			//error("reply", "Unable to reallocate dictionary");
+			// TODO: error
+			gen->reply_forward = gen->reply_size;
+			gen->forward_terms = gen->terms_size;
+			return;
+		}
+
+		/* Extend the current context of the model with the current symbol,
+		 * scoring it once there's enough of the reply for the context to be
+		 * the one it'll have when the reply is finished. */
+		if (scoring && (gen->reply_size > model->order)) {
+			if (!keep_term(ctx, gen, symbol)) {
+				// TODO: error
+				gen->reply_forward = gen->reply_size;
+				gen->forward_terms = gen->terms_size;
+				return;
+			}
+		} else {
+			update_context(gen, symbol);
+		}
 	}
 
-	/* Shuffle the nodes down so that we can insert the new node at the
-	 * subtree index given by position. */
-	for (i = tree->branch; i > position; --i) {
-		tree->tree[i] = tree->tree[i - 1];
+	gen->reply_forward = gen->reply_size;
+	gen->forward_terms = gen->terms_size;
+
+	/* Start off by making sure that the model's context is empty. */
+	initialize_cursor(gen, false);
+
+	/* Re-create the context of the model from the current reply so that
+	 * we can generate backwards to reach the beginning of the string. */
+	if (gen->reply_size > 0) {
+		for (i = MIN(gen->reply_size - 1, model->order); i >= 0; --i) {
+			update_context(gen, gen->reply[gen->reply_head + i]);
+		}
 	}
 
-	/* Add the new node to the sub-tree. */
-	tree->tree[position] = node;
-	tree->branch += 1;
+	/* Generate the reply in the backward direction. */
+	while (1) {
+		/* Get a random symbol from the current context. */
+		symbol = babble(gen);
+
+		if ((symbol == 0) || (symbol == 1)) {
+			break;
+		}
+
+		/* Prepend the symbol to the reply. */
+		if (!push_symbol(ctx, gen, symbol, true)) {
+			//error("reply", "Unable to reallocate dictionary");
+			//TODO: error
+			return;
+		}
+
+		/* Extend the current context of the model with the current symbol.
+		 * The backward walk when evaluating reaches it with this context
+		 * too, so score it as well. */
+		if (scoring) {
+			if (!keep_term(ctx, gen, symbol)) {
+				// TODO: error
+				return;
+			}
+		} else {
+			update_context(gen, symbol);
+		}
+	}
 }
 
+/* Start a new set of replies seen, keeping the slots for the next one. */
 static void
-generate_reply(megahal_ctx_t ctx, megahal_personality_t pers, struct megahal_dict *words, char *outstr, size_t outlen)
+forget_replies(struct generator *gen)
 {
-	struct megahal_model *model = pers->model;
-	struct megahal_dict *replywords;
-	struct megahal_dict *keywords;
-	float surprise;
-	float max_surprise;
-	int count;
-	int basetime;
-	int timeout = TIMEOUT;
+	register uint32_t i;
 
-	/* Create an array of keywords from the words in the user's input */
-	keywords = make_keywords(ctx, pers, words);
+	if (gen->seen != NULL) {
+		for (i = 0; i < (1u << gen->seen_bits); ++i) {
+			gen->seen[i] = 0;
+		}
+	}
 
-	strcpy(outstr, "I don't know enough to answer you yet!");
+	gen->seen_size = 0;
+}
 
-	replywords = new_dictionary(ctx);
-	reply(ctx, pers, NULL, replywords);
+/* Check whether the generator has come up with the reply before, adding
+ * it to the set if not.  Replies are only told apart by a hash of their
+ * symbols, so a collision costs a candidate that was never evaluated,
+ * which is no worse than not having generated it. */
+static bool
+seen_reply(megahal_ctx_t ctx, struct generator *gen)
+{
+	const uint32_t *reply = gen->reply + gen->reply_head;
+	register uint32_t i;
+	unsigned int bits;
+	uint64_t *seen;
+	uint64_t hash = 0xcbf29ce484222325ull ^ gen->reply_size;
+	uint64_t mask;
+	uint64_t h;
 
-	if (dissimilar(words, replywords) == true) {
-		make_output(replywords, outstr, outlen);
+	for (i = 0; i < gen->reply_size; ++i) {
+		hash = (hash ^ reply[i]) * 0x100000001b3ull;
+		hash ^= hash >> 29;
 	}
 
-	/* Loop for the specified waiting period, generating and evaluating
-	 * replies */
-	max_surprise = (float)-1.0;
-	count = 0;
-	basetime = time(NULL);
-#if 1
-	do {
-		reply(ctx, pers, keywords, replywords);
-		surprise = evaluate_reply(model, keywords, replywords);
-		++count;
-		if ((surprise > max_surprise) && (dissimilar(words, replywords) == true)) {
-			max_surprise = surprise;
-			make_output(replywords, outstr, outlen);
-		}
-	} while ((time(NULL) - basetime) < timeout);
-#else
-	int i;
-	for (i = 0; i < 9000; i++) {
-		replywords = reply(pers, keywords);
-		surprise = evaluate_reply(model, keywords, replywords);
-		++count;
-		if ((surprise>max_surprise) && (dissimilar(words, replywords) == true)) {
-			max_surprise = surprise;
-			output = make_output(replywords);
+	/* Zero marks an empty slot. */
+	if (hash == 0) {
+		hash = 1;
+	}
+
+	/* Keep the set at most half full, rehashing into a new one twice the
+	 * size when it gets there. */
+	if ((gen->seen == NULL) || ((2 * (gen->seen_size + 1)) > (1u << gen->seen_bits))) {
+		bits = (gen->seen == NULL) ? 10 : (gen->seen_bits + 1);
+		seen = (uint64_t *)af_malloc(ctx, sizeof(uint64_t) << bits);
+
+		if (seen == NULL) {
+			return false;
+		}
+
+		mask = (1u << bits) - 1;
+
+		for (i = 0; i <= mask; ++i) {
+			seen[i] = 0;
+		}
+
+		if (gen->seen != NULL) {
+			for (i = 0; i < (1u << gen->seen_bits); ++i) {
+				if (gen->seen[i] == 0) {
+					continue;
+				}
+
+				for (h = gen->seen[i] & mask; seen[h] != 0; h = (h + 1) & mask) {
+					;
+				}
+
+				seen[h] = gen->seen[i];
+			}
+
+			af_free(ctx, gen->seen);
 		}
+
+		gen->seen = seen;
+		gen->seen_bits = bits;
 	}
-#endif
 
-	free_dictionary(ctx, replywords);
-	af_free(ctx, replywords);
+	mask = (1u << gen->seen_bits) - 1;
+
+	for (h = hash & mask; gen->seen[h] != 0; h = (h + 1) & mask) {
+		if (gen->seen[h] == hash) {
+			return true;
+		}
+	}
+
+	gen->seen[h] = hash;
+	gen->seen_size += 1;
 
-	free_dictionary(ctx, keywords);
-	af_free(ctx, keywords);
+	return false;
 }
 
-static struct megahal_dict *
-make_keywords(megahal_ctx_t ctx, megahal_personality_t pers, struct megahal_dict *words)
+static uint32_t
+seed(struct generator *gen)
 {
-	struct megahal_dict *keys = NULL;
-	struct megahal_swaplist *swp = pers->swap;
+	struct keyset *keys = &gen->keys;
+	struct keyword *keyword;
+	const struct frozen_trie *view = gen->view;
+	NODEREF root = gen->cursor[0];
 	register unsigned int i;
-	register unsigned int j;
-	int c;
+	uint32_t symbol;
+	unsigned int stop;
 
-	keys = new_dictionary(ctx);
+	/* Fix, thanks to Mark Tarrabain */
+	if (ref_branch(view, root) == 0) {
+		symbol= 0;
+	} else {
+		symbol = ref_symbol(view, ref_child(view, root, rnd(gen, ref_branch(view, root))));
+	}
 
-	for (i = 0; i < words->size; ++i) {
-		/* Find the symbol ID of the word.  If it doesn't exist in the
-		 * model, or if it begins with a non-alphanumeric character, or if
-		 * it is in the exclusion array, then skip over it. */
-		c = 0;
-		for (j = 0; j < swp->size; ++j) {
-			if (wordcmp(swp->from[j], words->entry[i]) == 0) {
-				add_key(ctx, pers, keys, swp->to[j]);
-				++c;
+	if (keys->size > 0) {
+		i = rnd(gen, keys->size);
+		stop = i;
+		while (1) {
+			/* A snapshot taken before the keyword was learned can't
+			 * start a reply with it. */
+			keyword = &keys->keyword[i];
+
+			if ((keyword->symbol != 0) && (keyword->aux == false) &&
+			    (find_ref(view, root, keyword->symbol) != 0)) {
+				return keyword->symbol;
+			}
+
+			++i;
+
+			if (i == keys->size) {
+				i = 0;
+			}
+
+			if (i == stop) {
+				return symbol;
+			}
+		}
+	}
+
+	return symbol;
+}
+
+static uint32_t
+rnd(struct generator *gen, uint32_t range)
+{
+	return floor(erand48(gen->rng) * (double)range);
+}
+
+static uint32_t
+babble(struct generator *gen)
+{
+	megahal_personality_t pers = gen->pers;
+	struct keyset *keys = &gen->keys;
+	struct keyword *keyword;
+	const struct frozen_trie *view = gen->view;
+	NODEREF node;
+	register unsigned int i;
+	uint32_t branch;
+	uint32_t start;
+	uint32_t position;
+	uint32_t offset;
+	uint32_t symbol;
+	uint64_t steps;
+	uint64_t nearest;
+	int64_t count;
+
+	node = 0;
+
+	/* Select the longest available context. */
+	for (i = 0; i <= pers->model->order; ++i) {
+		if (gen->cursor[i] != 0) {
+			node = gen->cursor[i];
+		}
+	}
+
+	branch = ref_branch(view, node);
+
+	if (branch == 0) {
+		return 0;
+	}
+
+	/* Choose a symbol at random from this context, by walking the
+	 * children from a random one until a random share of the counts has
+	 * been used up. */
+	start = rnd(gen, branch);
+	count = rnd(gen, ref_usage(view, node));
+	steps = walk_children(view, node, branch, start, count, &position);
+
+	/* The walk stops early at the first keyword it passes, and only
+	 * takes an auxilliary keyword once a normal keyword has been used. */
+	if (keys->preferred == 0) {
+		return ref_symbol(view, ref_child(view, node, position));
+	}
+
+	nearest = steps + 1;
+
+	if (steps < keys->size) {
+		/* A short walk is cheapest to retrace child by child. */
+		for (offset = 0; offset <= MIN(steps, branch - 1); ++offset) {
+			symbol = ref_symbol(view, ref_child(view, node, (start + offset) % branch));
+			keyword = find_keyword(keys, symbol);
+
+			if ((keyword != NULL) && usable_keyword(gen, keyword)) {
+				nearest = offset;
+				break;
+			}
+		}
+	} else {
+		/* Otherwise find where each keyword sits and keep the first one
+		 * the walk would reach. */
+		for (i = 0; i < keys->size; ++i) {
+			keyword = &keys->keyword[i];
+
+			if (usable_keyword(gen, keyword) && ref_position(view, node, keyword->symbol, &offset)) {
+				offset = (offset >= start) ? (offset - start) : (offset + branch - start);
+				nearest = MIN(nearest, offset);
+			}
+		}
+	}
+
+	if (nearest <= steps) {
+		gen->used_key = true;
+		position = (start + nearest) % branch;
+	}
+
+	return ref_symbol(view, ref_child(view, node, position));
+}
+
+static bool
+usable_keyword(struct generator *gen, struct keyword *keyword)
+{
+	return keyword->preferred && (keyword->symbol != 0) && !keyword->used &&
+	       ((gen->used_key == true) || (keyword->aux == false));
+}
+
+/* Find the child at which a walk from the start child, taking each
+ * child's count off the given count, first takes it below zero.  Returns
+ * how many children the walk steps past, which may be more than the node
+ * has once the walk wraps around. */
+static uint64_t
+walk_children(const struct frozen_trie *view, NODEREF node, uint32_t branch, uint32_t start, int64_t count,
+	uint32_t *position)
+{
+	const uint32_t *cumulative;
+	uint64_t steps = 0;
+	uint64_t target;
+	uint64_t total;
+
+	/* Frozen nodes have running totals to search, unless those have
+	 * saturated. */
+	if (view != NULL) {
+		cumulative = view->cumulative + view->child[FROZEN_INDEX(node)];
+		total = cumulative[branch - 1];
+
+		if ((total > 0) && (total < UINT32_MAX)) {
+			target = (uint64_t)count + ((start > 0) ? cumulative[start - 1] : 0);
+
+			if (target < total) {
+				*position = search_cumulative(cumulative, start, branch, target);
+				return *position - start;
 			}
-		}
 
-		if (c == 0) {
-			add_key(ctx, pers, keys, words->entry[i]);
+			target -= total;
+			steps = (branch - start) + ((target / total) * branch);
+			*position = search_cumulative(cumulative, 0, branch, target % total);
+
+			return steps + *position;
 		}
 	}
 
-	if (keys->size > 0) {
-		for (i = 0; i < words->size; ++i) {
-			c =0;
-			for (j = 0; j < swp->size; ++j) {
-				if (wordcmp(swp->from[j], words->entry[i]) == 0) {
-					add_aux(ctx, pers, keys, swp->to[j]);
-					++c;
-				}
-			}
+	*position = start;
 
-			if (c == 0) {
-				add_aux(ctx, pers, keys, words->entry[i]);
-			}
+	while (true) {
+		count -= ref_count(view, ref_child(view, node, *position));
+
+		if (count < 0) {
+			return steps;
 		}
-	}
 
-	return keys;
+		*position = (*position >= (branch - 1)) ? 0 : *position + 1;
+		++steps;
+	}
 }
 
-static bool
-dissimilar(struct megahal_dict *words1, struct megahal_dict *words2)
+/* The first of the children from min on whose running total exceeds the
+ * target. */
+static uint32_t
+search_cumulative(const uint32_t *cumulative, uint32_t min, uint32_t max, uint64_t target)
 {
-	register unsigned int i;
+	uint32_t middle;
 
-	if (words1->size != words2->size) {
-		return true;
-	}
+	while (min < max) {
+		middle = min + (max - min) / 2;
 
-	for (i = 0; i < words1->size; ++i) {
-		if (wordcmp(words1->entry[i], words2->entry[i]) != 0) {
-			return true;
+		if (cumulative[middle] > target) {
+			max = middle;
+		} else {
+			min = middle + 1;
 		}
 	}
 
-	return false;
+	return min;
 }
 
 static void
-make_output(struct megahal_dict *words, char *outstr, size_t outlen)
+add_key(megahal_ctx_t ctx, megahal_personality_t pers, struct megahal_dict *dictionary, struct megahal_dict *keys, STRING word)
 {
-	register unsigned int i;
-	register int j;
-	int length;
+	uint32_t symbol;
 
-	if (words->size == 0) {
-		strcpy(outstr, "I am utterly speechless!");
+	symbol = find_word(dictionary, word);
+
+	if (symbol == 0) {
 		return;
 	}
 
-	length = 1;
-	for (i = 0; i < words->size; ++i) {
-		length += words->entry[i].length;
+	if (!alnum_word(ctx, word)) {
+		return;
 	}
 
-	if (outlen <= (size_t)length) {
-		printf("ERRROR!\n");
-		abort();
+	if (word_flags(ctx, pers, dictionary, symbol) != 0) {
 		return;
 	}
 
-#if 0
-	output = (char *)realloc(output, sizeof(char) * length);
+	add_word(ctx, keys, word);
+}
 
-	if (output == NULL) {
-		//error("make_output", "Unable to reallocate output.");
-		//TODO: Error
-		if (output_none != NULL) {
-			strcpy(output_none, "I forgot what I was going to say!");
-		}
+static void
+add_aux(megahal_ctx_t ctx, megahal_personality_t pers, struct megahal_dict *dictionary, struct megahal_dict *keys, STRING word)
+{
+	uint32_t symbol;
 
-		return output_none;
+	symbol = find_word(dictionary, word);
+	if (symbol == 0) {
+		return;
 	}
-#endif
 
-	length = 0;
+	if (!alnum_word(ctx, word)) {
+		return;
+	}
 
-	for (i = 0; i < words->size; ++i) {
-		for (j = 0; j < words->entry[i].length; ++j) {
-			outstr[length++] = words->entry[i].word[j];
-		}
+	if ((word_flags(ctx, pers, dictionary, symbol) & FLAG_AUX) == 0) {
+		return;
 	}
 
-	outstr[length] = '\0';
+	add_word(ctx, keys, word);
 }
 
-static float
-evaluate_reply(struct megahal_model *model, struct megahal_dict *keys, struct megahal_dict *words)
+/* Whether a word is banned or auxiliary, found the slow way. */
+static uint8_t
+find_flags(megahal_personality_t pers, STRING word)
 {
-	register unsigned int i;
-	register int j;
-	register int k;
-	int symbol;
-	float probability;
-	int count;
-	float entropy = 0.0f;
-	TREE *node;
-	int num = 0;
+	return ((find_word(pers->ban, word) != 0) ? FLAG_BANNED : 0) |
+		((find_word(pers->aux, word) != 0) ? FLAG_AUX : 0);
+}
 
-	if (words->size <= 0) {
-		return 0.0f;
-	}
+static bool
+current_flags(megahal_personality_t pers, const struct flag_set *set)
+{
+	return (set != NULL) && (set->model == pers->model) && (set->ban == pers->ban) && (set->aux == pers->aux) &&
+		(set->ban_size == ((pers->ban != NULL) ? pers->ban->size : 0)) &&
+		(set->aux_size == ((pers->aux != NULL) ? pers->aux->size : 0));
+}
 
-	initialize_context(model);
-	model->context[0] = model->forward;
+/* Whether the word with the given symbol in a dictionary of the
+ * personality's model is banned or auxiliary.  Snapshots' dictionaries
+ * number their words the same way as the model's, so one set does for
+ * all of them. */
+static uint8_t
+word_flags(megahal_ctx_t ctx, megahal_personality_t pers, struct megahal_dict *dictionary, uint32_t symbol)
+{
+	struct flag_set *set;
+	struct flag_set *grown;
+	struct flag_set *retired;
+	struct flag_set *next;
+	register uint32_t i;
+	uint32_t capacity;
+	uint32_t size = 0;
+	uint8_t flags;
 
-	for (i = 0; i < words->size; ++i) {
-		symbol = find_word(model->dictionary, words->entry[i]);
+	/* Count this reader before looking for the set, so that a set can't
+	 * be freed between being found and being read. */
+	__atomic_add_fetch(&pers->flags_readers, 1, __ATOMIC_SEQ_CST);
+	set = __atomic_load_n(&pers->flags, __ATOMIC_SEQ_CST);
 
-		if (find_word(keys, words->entry[i]) != 0) {
-			probability = 0.0f;
-			count = 0;
-			++num;
+	if (current_flags(pers, set) && (symbol < __atomic_load_n(&set->size, __ATOMIC_ACQUIRE))) {
+		flags = set->flag[symbol];
+		__atomic_sub_fetch(&pers->flags_readers, 1, __ATOMIC_SEQ_CST);
 
-			for (j = 0; j < model->order; ++j) {
-				if (model->context[j] != NULL) {
-					node = find_symbol(model->context[j], symbol);
-					probability += (float)(node->count) / (float)(model->context[j]->usage);
-					++count;
-				}
-			}
+		return flags;
+	}
 
-			if (count > 0.0) {
-				entropy -= (float)log(probability / (float)count);
-			}
-		}
+	__atomic_sub_fetch(&pers->flags_readers, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&pers->flags_lock);
 
-		update_context(model, symbol);
+	set = pers->flags;
+
+	if (current_flags(pers, set)) {
+		size = set->size;
 	}
 
-	initialize_context(model);
-	model->context[0] = model->backward;
+	/* Replace the set if it can't be added to. */
+	if ((size == 0) || (dictionary->size > set->capacity)) {
+		capacity = MAX(dictionary->size, (size == 0) ? 0 : (set->capacity * 2));
+		grown = (struct flag_set *)af_malloc(ctx, sizeof(struct flag_set) + capacity);
+
+		if (grown == NULL) {
+			pthread_mutex_unlock(&pers->flags_lock);
+			return find_flags(pers, dictionary->entry[symbol]);
+		}
 
-	for (k = words->size - 1; k >= 0; --k) {
-		symbol = find_word(model->dictionary, words->entry[k]);
+		grown->model = pers->model;
+		grown->ban = pers->ban;
+		grown->aux = pers->aux;
+		grown->ban_size = (pers->ban != NULL) ? pers->ban->size : 0;
+		grown->aux_size = (pers->aux != NULL) ? pers->aux->size : 0;
+		grown->size = size;
+		grown->capacity = capacity;
+		grown->retired = set;
+
+		if (size > 0) {
+			memcpy(grown->flag, set->flag, size);
+		}
 
-		if (find_word(keys, words->entry[k]) != 0) {
-			probability = 0.0f;
-			count = 0;
-			++num;
+		__atomic_store_n(&pers->flags, grown, __ATOMIC_SEQ_CST);
+		set = grown;
 
-			for (j = 0; j < model->order; ++j) {
-				if (model->context[j] != NULL) {
-					node = find_symbol(model->context[j], symbol);
-					probability += (float)(node->count) / (float)(model->context[j]->usage);
-					++count;
-				}
+		/* Any reader that comes along now finds the new set, so once
+		 * none are left the retired ones can go. */
+		if (__atomic_load_n(&pers->flags_readers, __ATOMIC_SEQ_CST) == 0) {
+			for (retired = set->retired; retired != NULL; retired = next) {
+				next = retired->retired;
+				af_free(ctx, retired);
 			}
 
-			if (count > 0) {
-				entropy -= (float)log(probability / (float)count);
-			}
+			set->retired = NULL;
 		}
-
-		update_context(model, symbol);
 	}
 
-	if (num >= 8) {
-		entropy /= (float)sqrt(num - 1);
+	for (i = size; i < dictionary->size; ++i) {
+		set->flag[i] = find_flags(pers, dictionary->entry[i]);
 	}
 
-	if (num>=16) {
-		entropy /= (float)num;
+	if (dictionary->size > size) {
+		__atomic_store_n(&set->size, dictionary->size, __ATOMIC_RELEASE);
 	}
 
-	return entropy;
-}
-
-static void
-reply(megahal_ctx_t ctx, megahal_personality_t pers, struct megahal_dict *keys, struct megahal_dict *replies)
-{
-	struct megahal_model *model = pers->model;
-	register int i;
-	int symbol;
-	bool start = true;
+	flags = (symbol < set->size) ? set->flag[symbol] : find_flags(pers, dictionary->entry[symbol]);
 
-	free_dictionary(ctx, replies);
+	pthread_mutex_unlock(&pers->flags_lock);
 
-	/* Start off by making sure that the model's context is empty. */
-	initialize_context(model);
-	model->context[0] = model->forward;
-	pers->used_key = false;
+	return flags;
+}
 
-	/* Generate the reply in the forward direction. */
-	while (1) {
-		/* Get a random symbol from the current context. */
-		if (start == true) {
-			symbol = seed(pers, keys);
-		} else {
-			symbol = babble(pers, keys, replies);
-		}
+static bool
+writer_open(megahal_ctx_t ctx, struct writer *writer, const char *path)
+{
+	static unsigned int serial = 0;
+	char *resolved;
+	struct stat st;
+	bool existing;
+	size_t length;
 
-		if ((symbol == 0) || (symbol == 1)) {
-			break;
-		}
+	writer->used = 0;
+	writer->bytes = 0;
+	writer->error = false;
+	writer->path = NULL;
 
-		start = false;
+	/* Save through a symlink to the file it names, so the link itself
+	 * survives the rename; a path that does not exist yet is used as
+	 * given. */
+	resolved = realpath(path, NULL);
+	length = strlen(resolved != NULL ? resolved : path) + 1;
+	writer->target = af_malloc(ctx, length);
 
-		/* Append the symbol to the reply dictionary. */
-		if (replies->entry == NULL) {
-			replies->entry = (STRING *)af_malloc(ctx, (replies->size + 1) * sizeof(STRING));
-		} else {
-			replies->entry = (STRING *)af_realloc(ctx, replies->entry, (replies->size + 1) * sizeof(STRING));
-		}
+	if (writer->target != NULL) {
+		memcpy(writer->target, resolved != NULL ? resolved : path, length);
+	}
 
-		if (replies->entry == NULL) {
-			//error("reply", "Unable to reallocate dictionary");
-			// TODO: error
-			return;
-		}
+	free(resolved);
 
-		replies->entry[replies->size].length = model->dictionary->entry[symbol].length;
-		replies->entry[replies->size].word = model->dictionary->entry[symbol].word;
-		replies->size += 1;
+	length += 48;
+	writer->buffer = af_malloc(ctx, WRITER_BUFFER);
+	writer->path = af_malloc(ctx, length);
 
-		/* Extend the current context of the model with the current symbol. */
-		update_context(model, symbol);
+	if ((writer->target == NULL) || (writer->buffer == NULL) || (writer->path == NULL)) {
+		goto fail;
 	}
 
-	/* Start off by making sure that the model's context is empty. */
-	initialize_context(model);
-	model->context[0] = model->backward;
+	existing = (stat(writer->target, &st) == 0);
 
-	/* Re-create the context of the model from the current reply dictionary
-	 * so that we can generate backwards to reach the beginning of the
-	 * string. */
-	if (replies->size > 0) {
-		for (i = MIN(replies->size - 1, model->order); i >= 0; --i) {
-			symbol = find_word(model->dictionary, replies->entry[i]);
-			update_context(model, symbol);
-		}
-	}
+	/* Every save gets a temporary file of its own, even when another
+	 * thread is saving to the same path; one left over from an earlier
+	 * process with the same pid is stepped around. */
+	do {
+		snprintf(writer->path, length, "%s.%ld.%u.tmp", writer->target, (long)getpid(), __sync_fetch_and_add(&serial, 1));
+		writer->fd = open(writer->path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	} while ((writer->fd < 0) && (errno == EEXIST));
 
-	/* Generate the reply in the backward direction. */
-	while (1) {
-		/* Get a random symbol from the current context. */
-		symbol = babble(pers, keys, replies);
+	if (writer->fd < 0) {
+		goto fail;
+	}
 
-		if ((symbol == 0) || (symbol == 1)) {
-			break;
+	/* The new file replaces the old one, so it takes over its mode and,
+	 * where we are allowed to, its owner. */
+	if (existing) {
+		if (fchown(writer->fd, st.st_uid, st.st_gid) != 0) {
+			/* Not ours to give away; keep our own. */
 		}
 
-		/* Prepend the symbol to the reply dictionary. */
-		if (replies->entry == NULL) {
-			replies->entry = (STRING *)af_malloc(ctx, (replies->size + 1) * sizeof(STRING));
-		} else {
-			replies->entry = (STRING *)af_realloc(ctx, replies->entry, (replies->size + 1) * sizeof(STRING));
+		if (fchmod(writer->fd, st.st_mode & 07777) != 0) {
+			close(writer->fd);
+			unlink(writer->path);
+			goto fail;
 		}
+	}
 
-		if (replies->entry==NULL) {
-			//error("reply", "Unable to reallocate dictionary");
-			//TODO: error
-			return;
-		}
+	return true;
 
-		/* Shuffle everything up for the prepend. */
-		for (i = replies->size; i > 0; --i) {
-			replies->entry[i].length = replies->entry[i - 1].length;
-			replies->entry[i].word = replies->entry[i - 1].word;
-		}
+fail:
+	if (writer->target != NULL) {
+		af_free(ctx, writer->target);
+	}
 
-		replies->entry[0].length = model->dictionary->entry[symbol].length;
-		replies->entry[0].word = model->dictionary->entry[symbol].word;
-		replies->size += 1;
+	if (writer->buffer != NULL) {
+		af_free(ctx, writer->buffer);
+	}
 
-		/* Extend the current context of the model with the current symbol. */
-		update_context(model, symbol);
+	if (writer->path != NULL) {
+		af_free(ctx, writer->path);
 	}
+
+	return false;
 }
 
-static int
-seed(megahal_personality_t pers, struct megahal_dict *keys)
+static void
+writer_write(struct writer *writer, const char *data, size_t sz)
 {
-	register unsigned int i;
-	int symbol;
-	unsigned int stop;
+	ssize_t n;
 
-	/* Fix, thanks to Mark Tarrabain */
-	if (pers->model->context[0]->branch == 0) {
-		symbol= 0;
-	} else {
-		symbol = pers->model->context[0]->tree[rnd(pers->model->context[0]->branch)]->symbol;
-	}
+	while ((sz > 0) && !writer->error) {
+		n = write(writer->fd, data, sz);
 
-	if (keys && keys->size > 0) {
-		i = rnd(keys->size);
-		stop = i;
-		while (1) {
-			if ((find_word(pers->model->dictionary, keys->entry[i]) != 0) &&
-			    (find_word(pers->aux, keys->entry[i]) == 0)) {
-				symbol = find_word(pers->model->dictionary, keys->entry[i]);
-				return symbol;
+		if (n < 0) {
+			if (errno != EINTR) {
+				writer->error = true;
 			}
 
-			++i;
+			continue;
+		}
 
-			if (i == keys->size) {
-				i = 0;
-			}
+		data += n;
+		sz -= n;
+	}
+}
 
-			if (i == stop) {
-				return symbol;
-			}
+static void
+writer_put(struct writer *writer, const void *data, size_t sz)
+{
+	writer->bytes += sz;
+
+	if (sz > (WRITER_BUFFER - writer->used)) {
+		writer_write(writer, writer->buffer, writer->used);
+		writer->used = 0;
+
+		/* Anything that wouldn't fit in the buffer bypasses it. */
+		if (sz >= WRITER_BUFFER) {
+			writer_write(writer, data, sz);
+			return;
 		}
 	}
 
-	return symbol;
+	memcpy(writer->buffer + writer->used, data, sz);
+	writer->used += sz;
 }
 
-static int
-rnd(int range)
+static bool
+writer_commit(megahal_ctx_t ctx, struct writer *writer)
 {
-	return floor(drand48() * (double)range);
-}
+	bool ok;
 
-static int
-babble(megahal_personality_t pers, struct megahal_dict *keys, struct megahal_dict *words)
-{
-	TREE *node;
-	register int i;
-	int count;
-	int symbol = 0;
+	writer_write(writer, writer->buffer, writer->used);
+	writer->used = 0;
 
-	node = NULL;
+	ok = !writer->error && (fsync(writer->fd) == 0);
+	ok = (close(writer->fd) == 0) && ok;
+	ok = ok && (rename(writer->path, writer->target) == 0);
 
-	/* Select the longest available context. */
-	for (i = 0; i <= pers->model->order; ++i) {
-		if (pers->model->context[i] != NULL) {
-			node = pers->model->context[i];
-		}
+	if (!ok) {
+		unlink(writer->path);
 	}
 
-	if (node->branch == 0) {
-		return 0;
-	}
+	/* The rename itself only lasts once the directory is on disk. */
+	ok = ok && sync_directory(writer->path);
 
-	/* Choose a symbol at random from this context. */
-	i = rnd(node->branch);
-	count = rnd(node->usage);
-	while (count >= 0) {
-		/* If the symbol occurs as a keyword, then use it.  Only use an
-		 * auxilliary keyword if a normal keyword has already been used. */
-		symbol = node->tree[i]->symbol;
+	af_free(ctx, writer->target);
+	af_free(ctx, writer->buffer);
+	af_free(ctx, writer->path);
 
-		if ((find_word(keys, pers->model->dictionary->entry[symbol]) != 0) &&
-		    ((pers->used_key == true) ||
-		     (find_word(pers->aux, pers->model->dictionary->entry[symbol]) == 0)) &&
-		    (word_exists(words, pers->model->dictionary->entry[symbol]) == false)) {
-			pers->used_key = true;
-			break;
-		}
+	return ok;
+}
 
-		count -= node->tree[i]->count;
-		i = (i >= (node->branch - 1)) ? 0 : i + 1;
+/* Flush the directory holding path, which is cut down to the directory's
+ * name in the process. */
+static bool
+sync_directory(char *path)
+{
+	char *slash = strrchr(path, '/');
+	const char *dir = path;
+	bool ok;
+	int fd;
+
+	if (slash == NULL) {
+		dir = ".";
+	} else if (slash == path) {
+		slash[1] = '\0';
+	} else {
+		slash[0] = '\0';
 	}
 
-	return symbol;
+	fd = open(dir, O_RDONLY);
+
+	if (fd < 0) {
+		return false;
+	}
+
+	ok = (fsync(fd) == 0);
+	ok = (close(fd) == 0) && ok;
+
+	return ok;
 }
 
-static bool
-word_exists(struct megahal_dict *dictionary, STRING word)
+static double
+elapsed_seconds(const struct timespec *start)
 {
-	register unsigned int i;
+	struct timespec now;
 
-	for (i = 0; i<dictionary->size; ++i) {
-		if (wordcmp(dictionary->entry[i], word) == 0) {
-			return true;
-		}
-	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	return false;
+	return (double)(now.tv_sec - start->tv_sec) + ((double)(now.tv_nsec - start->tv_nsec) / 1e9);
 }
 
-static void
-add_key(megahal_ctx_t ctx, megahal_personality_t pers, struct megahal_dict *keys, STRING word)
+static bool
+save_model(megahal_ctx_t ctx, const char *path, struct megahal_model *model, megahal_save_stats_t *stats)
 {
-	struct megahal_model *model = pers->model;
-	int symbol;
+	struct writer writer;
+	struct timespec start;
 
-	symbol = find_word(model->dictionary, word);
+	sync_model(model);
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-	if (symbol == 0) {
-		return;
+	if (!writer_open(ctx, &writer, path)) {
+		//warn("save_model", "Unable to open file `%s'", filename);
+		//TODO: warn
+		return false;
 	}
 
-	if (isalnum(word.word[0]) == 0) {
-		return;
-	}
+	writer_put(&writer, model->wide ? WIDE_COOKIE : COOKIE, strlen(COOKIE));
+	writer_put(&writer, &(model->order), sizeof(uint8_t));
+	save_tree(&writer, model->forward, model->wide);
+	save_tree(&writer, model->backward, model->wide);
+	save_dictionary(&writer, model->dictionary, model->wide);
 
-	symbol = find_word(pers->ban, word);
-	if (symbol != 0) {
-		return;
+	if (!writer_commit(ctx, &writer)) {
+		return false;
 	}
 
-	symbol = find_word(pers->aux, word);
-	if (symbol != 0) {
-		return;
+	if (stats != NULL) {
+		stats->bytes = writer.bytes;
+		stats->seconds = elapsed_seconds(&start);
+		stats->bytes_per_sec = (stats->seconds > 0.0) ? ((double)writer.bytes / stats->seconds) : 0.0;
 	}
 
-	add_word(ctx, keys, word);
+	return true;
 }
 
 static void
-add_aux(megahal_ctx_t ctx, megahal_personality_t pers, struct megahal_dict *keys, STRING word)
+save_tree(struct writer *writer, TREE *node, bool wide)
 {
-	struct megahal_model *model = pers->model;
-	int symbol;
+	register unsigned int i;
 
-	symbol = find_word(model->dictionary, word);
-	if (symbol == 0) {
-		return;
-	}
+	save_number(writer, node->symbol, sizeof(uint16_t), wide);
+	save_number(writer, node->usage, sizeof(uint32_t), wide);
+	save_number(writer, node->count, sizeof(uint16_t), wide);
+	save_number(writer, node->branch, sizeof(uint16_t), wide);
 
-	if (isalnum(word.word[0]) == 0) {
-		return;
-	}
+	sort_children(node);
 
-	symbol = find_word(pers->aux, word);
-	if (symbol == 0) {
-		return;
+	for (i = 0; i < node->branch; ++i) {
+		save_tree(writer, node_child(node, i), wide);
 	}
-
-	add_word(ctx, keys, word);
 }
 
 static void
-save_model(const char *path, struct megahal_model *model)
+save_dictionary(struct writer *writer, struct megahal_dict *dictionary, bool wide)
 {
-	FILE *file;
+	register unsigned int i;
 
-	file = fopen(path, "wb");
+	save_number(writer, dictionary->size, sizeof(uint32_t), wide);
 
-	if (file == NULL) {
-		//warn("save_model", "Unable to open file `%s'", filename);
-		//TODO: warn
-		return;
+	for (i = 0; i < dictionary->size; ++i) {
+		save_word(writer, dictionary->entry[i], wide);
 	}
-
-	fwrite(COOKIE, sizeof(char), strlen(COOKIE), file);
-	fwrite(&(model->order), sizeof(uint8_t), 1, file);
-	save_tree(file, model->forward);
-	save_tree(file, model->backward);
-	save_dictionary(file, model->dictionary);
-
-	fclose(file);
 }
 
+/* Version 8 files store every field at a fixed width; the wide format
+ * stores them all as little endian base 128 varints instead. */
 static void
-save_tree(FILE *file, TREE *node)
+save_number(struct writer *writer, uint32_t value, size_t size, bool wide)
 {
-	register unsigned int i;
+	uint8_t byte;
+	uint16_t half;
+
+	if (wide) {
+		while (value >= 0x80) {
+			byte = (uint8_t)(value | 0x80);
+			writer_put(writer, &byte, sizeof(byte));
+			value >>= 7;
+		}
 
-	fwrite(&(node->symbol), sizeof(uint16_t), 1, file);
-	fwrite(&(node->usage), sizeof(uint32_t), 1, file);
-	fwrite(&(node->count), sizeof(uint16_t), 1, file);
-	fwrite(&(node->branch), sizeof(uint16_t), 1, file);
+		byte = (uint8_t)value;
+		writer_put(writer, &byte, sizeof(byte));
+		return;
+	}
 
-	for (i = 0; i < node->branch; ++i) {
-		save_tree(file, node->tree[i]);
+	switch (size) {
+	case sizeof(uint8_t):
+		byte = (uint8_t)value;
+		writer_put(writer, &byte, sizeof(byte));
+		break;
+	case sizeof(uint16_t):
+		half = (uint16_t)value;
+		writer_put(writer, &half, sizeof(half));
+		break;
+	default:
+		writer_put(writer, &value, sizeof(value));
+		break;
 	}
 }
 
-static void
-save_dictionary(FILE *file, struct megahal_dict *dictionary)
+static uint32_t
+load_number(FILE *file, size_t size, bool wide)
 {
-	register unsigned int i;
+	register unsigned int shift;
+	uint32_t value = 0;
+	uint16_t half = 0;
+	uint8_t byte = 0;
+	int c;
 
-	fwrite(&(dictionary->size), sizeof(uint32_t), 1, file);
+	if (wide) {
+		for (shift = 0; shift < 35; shift += 7) {
+			if ((c = getc(file)) == EOF) {
+				break;
+			}
 
-	for (i = 0; i < dictionary->size; ++i) {
-		save_word(file, dictionary->entry[i]);
+			value |= (uint32_t)(c & 0x7f) << shift;
+
+			if ((c & 0x80) == 0) {
+				break;
+			}
+		}
+
+		return value;
+	}
+
+	switch (size) {
+	case sizeof(uint8_t):
+		fread(&byte, sizeof(byte), 1, file);
+		return byte;
+	case sizeof(uint16_t):
+		fread(&half, sizeof(half), 1, file);
+		return half;
+	default:
+		fread(&value, sizeof(value), 1, file);
+		return value;
 	}
 }
 
 static void
 capitalize(char *string)
 {
-	register unsigned int i;
+	const struct char_table *table = character_table();
+	unsigned char *s = (unsigned char *)string;
+	register size_t i;
+	size_t length = strlen(string);
 	bool start = true;
 
-	for (i = 0; i < strlen(string); ++i) {
-		if (isalpha(string[i])) {
+	for (i = 0; i < length; ++i) {
+		if ((table->class[s[i]] & CHAR_ALPHA) != 0) {
 			if (start == true) {
-				string[i] = (char)toupper((int)string[i]);
+				s[i] = table->upper[s[i]];
 			} else {
-				string[i] = (char)tolower((int)string[i]);
+				s[i] = table->lower[s[i]];
 			}
 
 			start = false;
 		}
 
-		if ((i > 2) && (strchr("!.?", string[i - 1]) != NULL) &&
-		    (isspace(string[i]))) {
+		if ((i > 2) && ((s[i - 1] == '!') || (s[i - 1] == '.') || (s[i - 1] == '?')) &&
+		    ((table->class[s[i]] & CHAR_SPACE) != 0)) {
 			start = true;
 		}
 	}
@@ -1,6 +1,8 @@
 #ifndef LIBMEGAHAL_H
 #define LIBMEGAHAL_H
 
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 typedef struct megahal_ctx * megahal_ctx_t;
@@ -8,6 +10,7 @@ typedef struct megahal_model * megahal_model_t;
 typedef struct megahal_personality * megahal_personality_t;
 typedef struct megahal_dict * megahal_dict_t;
 typedef struct megahal_swaplist * megahal_swaplist_t;
+typedef struct megahal_genstate * megahal_genstate_t;
 
 typedef void * (* megahal_alloc_func_t)(void *ctx, size_t sz);
 typedef void * (* megahal_realloc_func_t)(void *ctx, void *ptr, size_t sz);
@@ -20,9 +23,49 @@ typedef struct {
 	void                   *ctx;
 } megahal_alloc_funcs_t;
 
+typedef struct {
+	uint64_t  bytes;
+	double    seconds;
+	double    bytes_per_sec;
+} megahal_save_stats_t;
+
+typedef struct {
+	uint64_t  lines;
+	uint64_t  sentences;
+	uint64_t  bytes;
+	double    seconds;
+	double    sentences_per_sec;
+} megahal_learn_stats_t;
+
+typedef struct {
+	uint32_t  max_candidates;
+	uint64_t  time_budget_us;
+	uint32_t  threads;
+} megahal_reply_opts_t;
+
+typedef struct {
+	uint32_t  every_sentences;
+	uint64_t  interval_us;
+} megahal_publish_opts_t;
+
+typedef enum {
+	MEGAHAL_TOKENIZER_BYTES = 0,
+	MEGAHAL_TOKENIZER_UTF8
+} megahal_tokenizer_t;
+
+typedef struct {
+	uint32_t  candidates;
+	uint32_t  duplicates;
+	double    duplicate_ratio;
+	double    seconds;
+	float     surprise;
+} megahal_reply_stats_t;
+
 int megahal_ctx_init(megahal_ctx_t *, megahal_alloc_funcs_t *);
+int megahal_ctx_set_tokenizer(megahal_ctx_t, megahal_tokenizer_t);
 
 int megahal_personality_init(megahal_ctx_t, megahal_personality_t *);
+int megahal_personality_free(megahal_ctx_t, megahal_personality_t);
 
 int megahal_personality_set_model(megahal_personality_t, megahal_model_t);
 int megahal_personality_set_ban(megahal_personality_t, megahal_dict_t);
@@ -30,8 +73,18 @@ int megahal_personality_set_aux(megahal_personality_t, megahal_dict_t);
 int megahal_personality_set_swap(megahal_personality_t, megahal_swaplist_t);
 
 int megahal_model_init(megahal_ctx_t, megahal_model_t *);
+int megahal_model_free(megahal_ctx_t, megahal_model_t);
+int megahal_model_freeze(megahal_ctx_t, megahal_model_t);
+int megahal_model_unfreeze(megahal_ctx_t, megahal_model_t);
+int megahal_model_widen(megahal_ctx_t, megahal_model_t);
+int megahal_model_set_concurrent(megahal_ctx_t, megahal_model_t, int);
+int megahal_model_set_publishing(megahal_ctx_t, megahal_model_t, const megahal_publish_opts_t *);
+int megahal_model_publish(megahal_ctx_t, megahal_model_t);
 int megahal_model_load_file(megahal_ctx_t, const char *, megahal_model_t *);
 int megahal_model_save_file(megahal_ctx_t, megahal_model_t, const char *);
+int megahal_model_save_file_stats(megahal_ctx_t, megahal_model_t, const char *, megahal_save_stats_t *);
+int megahal_model_load_mapped(megahal_ctx_t, const char *, megahal_model_t *);
+int megahal_model_save_mapped(megahal_ctx_t, megahal_model_t, const char *);
 
 int megahal_dict_init(megahal_ctx_t, megahal_dict_t *);
 int megahal_dict_add_word(megahal_ctx_t, megahal_dict_t, const char *);
@@ -40,7 +93,20 @@ int megahal_swaplist_init(megahal_ctx_t, megahal_swaplist_t *);
 int megahal_swaplist_add_swap(megahal_ctx_t, megahal_swaplist_t, const char *, const char *);
 
 int megahal_learn(megahal_ctx_t, megahal_personality_t, const char *);
+int megahal_learn_buffer(megahal_ctx_t, megahal_personality_t, const char *, size_t, megahal_learn_stats_t *);
+int megahal_learn_fd(megahal_ctx_t, megahal_personality_t, int, megahal_learn_stats_t *);
+int megahal_learn_file(megahal_ctx_t, megahal_personality_t, FILE *, megahal_learn_stats_t *);
+int megahal_learn_parallel(megahal_ctx_t, megahal_personality_t, const char *, size_t, unsigned int, megahal_learn_stats_t *);
+int megahal_learn_path_parallel(megahal_ctx_t, megahal_personality_t, const char *, unsigned int, megahal_learn_stats_t *);
 int megahal_reply(megahal_ctx_t, megahal_personality_t, const char *, char *, size_t);
+int megahal_reply_ex(megahal_ctx_t, megahal_personality_t, const char *, char *, size_t,
+	const megahal_reply_opts_t *, megahal_reply_stats_t *);
+
+int megahal_genstate_init(megahal_ctx_t, megahal_genstate_t *);
+int megahal_genstate_free(megahal_ctx_t, megahal_genstate_t);
+int megahal_genstate_seed(megahal_genstate_t, uint64_t);
+int megahal_reply_state(megahal_ctx_t, megahal_personality_t, megahal_genstate_t, const char *, char *, size_t,
+	const megahal_reply_opts_t *, megahal_reply_stats_t *);
 
 #endif // LIBMEGAHAL_H
 
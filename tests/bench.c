@@ -0,0 +1,154 @@
+/* Throughput of the tokenizer and of the reply search.  The input is
+ * split both a line at a time and as one long input, in each tokenizer
+ * mode, and replies are searched with a fixed candidate budget so the
+ * candidate rate and duplicate ratio can be compared between builds.
+ *
+ *   cc -std=gnu99 -O2 -pthread tests/bench.c -lm && ./a.out [file]
+ *
+ * Without a file, a synthetic corpus is generated.
+ */
+#include "../libmegahal.c"
+
+static char *
+synthetic(size_t *length)
+{
+	static const char *words[] = {
+		"the", "buffer", "window", "file", "is", "opened", "in", "a", "new",
+		"command", "line", "Vim's", "cursor", "moves", "to", "text", "and",
+		"12", "3.5", "mode", "search", "pattern", "matches", "every", "word"
+	};
+	size_t capacity = 8 * 1024 * 1024;
+	char *text = malloc(capacity);
+	size_t used = 0;
+	unsigned int i = 0;
+	unsigned int n = 0;
+
+	while ((used + 64) < capacity) {
+		used += sprintf(text + used, "%s", words[(i * 7 + n * 13) % (sizeof(words) / sizeof(words[0]))]);
+		text[used++] = ((++i % 11) == 0) ? '\n' : ' ';
+		n += i % 3;
+	}
+
+	*length = used;
+
+	return text;
+}
+
+static double
+tokenize(megahal_ctx_t ctx, const char *text, size_t length, bool lines, uint64_t *tokens)
+{
+	struct megahal_dict *words = new_dictionary(ctx);
+	struct timespec start;
+	const char *line = text;
+	const char *end = text + length;
+	const char *newline;
+	double seconds;
+
+	*tokens = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (lines) {
+		while (line < end) {
+			newline = memchr(line, '\n', end - line);
+			newline = (newline == NULL) ? end : newline;
+			make_words(ctx, line, newline - line, words);
+			*tokens += words->size;
+			line = newline + 1;
+		}
+	} else {
+		make_words(ctx, text, length, words);
+		*tokens = words->size;
+	}
+
+	seconds = elapsed_seconds(&start);
+	free_dictionary(ctx, words);
+	af_free(ctx, words);
+
+	return seconds;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const char *inputs[] = {
+		"what is a buffer", "how do I open a file in a window", "the cursor", "search for a pattern"
+	};
+	megahal_ctx_t ctx;
+	megahal_personality_t pers;
+	megahal_model_t model;
+	megahal_dict_t ban = NULL;
+	megahal_dict_t aux = NULL;
+	megahal_swaplist_t swap = NULL;
+	megahal_learn_stats_t learned;
+	megahal_reply_stats_t replied;
+	megahal_reply_opts_t opts = { 1000, 0, 1 };
+	uint64_t candidates = 0;
+	uint64_t duplicates = 0;
+	uint64_t tokens;
+	double seconds = 0.0;
+	char output[4096];
+	char *text;
+	size_t length;
+	FILE *file;
+	int mode;
+	int i;
+
+	if (argc > 1) {
+		file = fopen(argv[1], "rb");
+
+		if (file == NULL) {
+			perror(argv[1]);
+			return 1;
+		}
+
+		fseek(file, 0, SEEK_END);
+		length = ftell(file);
+		rewind(file);
+		text = malloc(length);
+		length = fread(text, 1, length, file);
+		fclose(file);
+	} else {
+		text = synthetic(&length);
+	}
+
+	megahal_ctx_init(&ctx, NULL);
+
+	for (mode = MEGAHAL_TOKENIZER_BYTES; mode <= MEGAHAL_TOKENIZER_UTF8; ++mode) {
+		megahal_ctx_set_tokenizer(ctx, mode);
+		seconds = tokenize(ctx, text, length, true, &tokens);
+		printf("tokenize %-5s by line:  %.1f Mtok/s (%llu tokens)\n", (mode == MEGAHAL_TOKENIZER_UTF8) ? "utf8" : "bytes",
+			tokens / seconds / 1e6, (unsigned long long)tokens);
+		seconds = tokenize(ctx, text, length, false, &tokens);
+		printf("tokenize %-5s one input: %.1f Mtok/s (%llu tokens)\n", (mode == MEGAHAL_TOKENIZER_UTF8) ? "utf8" : "bytes",
+			tokens / seconds / 1e6, (unsigned long long)tokens);
+	}
+
+	megahal_ctx_set_tokenizer(ctx, MEGAHAL_TOKENIZER_BYTES);
+	megahal_personality_init(ctx, &pers);
+	megahal_model_init(ctx, &model);
+	megahal_personality_set_model(pers, model);
+	megahal_dict_init(ctx, &ban);
+	megahal_dict_init(ctx, &aux);
+	megahal_swaplist_init(ctx, &swap);
+	megahal_personality_set_ban(pers, ban);
+	megahal_personality_set_aux(pers, aux);
+	megahal_personality_set_swap(pers, swap);
+
+	megahal_learn_buffer(ctx, pers, text, length, &learned);
+	printf("learn: %.0f sentences/s (%llu sentences)\n", learned.sentences_per_sec, (unsigned long long)learned.sentences);
+
+	for (i = 0; i < 20; ++i) {
+		megahal_reply_ex(ctx, pers, inputs[i % 4], output, sizeof(output), &opts, &replied);
+		candidates += replied.candidates;
+		duplicates += replied.duplicates;
+		seconds += replied.seconds;
+	}
+
+	printf("reply: %.0f candidates/s, %.1f%% duplicates\n", candidates / seconds,
+		(candidates > 0) ? (100.0 * duplicates / candidates) : 0.0);
+
+	megahal_model_free(ctx, model);
+	free(text);
+
+	return 0;
+}
@@ -0,0 +1,134 @@
+/* Replies made from a published snapshot must not wait for a writer.
+ * This holds the model's lock for writing, as a learner would while
+ * learning or publishing, and checks that a reply still finishes and
+ * that its input is learned once the lock is given up.  Input deferred
+ * by a reply must also make it into a mapped save.
+ *
+ *   cc -std=gnu99 -pthread tests/reply_unblocked.c -lm && ./a.out
+ */
+#include "../libmegahal.c"
+
+static megahal_ctx_t ctx;
+static megahal_personality_t pers;
+static int replied;
+
+static void *
+reply_thread(void *arg)
+{
+	megahal_genstate_t state;
+	megahal_reply_opts_t opts = { 10, 0, 1 };
+	char output[1024];
+
+	(void)arg;
+
+	megahal_genstate_init(ctx, &state);
+	megahal_reply_state(ctx, pers, state, "the quick zebra jumps over the lazy dog", output, sizeof(output), &opts, NULL);
+	megahal_genstate_free(ctx, state);
+
+	__atomic_store_n(&replied, 1, __ATOMIC_SEQ_CST);
+
+	return NULL;
+}
+
+int
+main(void)
+{
+	megahal_model_t model;
+	megahal_model_t mapped = NULL;
+	megahal_dict_t ban = NULL;
+	megahal_dict_t aux = NULL;
+	megahal_swaplist_t swap = NULL;
+	megahal_publish_opts_t publish = { 1000, 0 };
+	pthread_t thread;
+	megahal_reply_opts_t opts = { 10, 0, 1 };
+	STRING zebra = { 5, "ZEBRA" };
+	STRING giraffe = { 7, "GIRAFFE" };
+	char output[1024];
+	int failed = 0;
+	int i;
+
+	megahal_ctx_init(&ctx, NULL);
+	megahal_personality_init(ctx, &pers);
+	megahal_model_init(ctx, &model);
+	megahal_personality_set_model(pers, model);
+	megahal_dict_init(ctx, &ban);
+	megahal_dict_init(ctx, &aux);
+	megahal_swaplist_init(ctx, &swap);
+	megahal_personality_set_ban(pers, ban);
+	megahal_personality_set_aux(pers, aux);
+	megahal_personality_set_swap(pers, swap);
+
+	megahal_learn(ctx, pers, "the quick brown fox jumps over the lazy dog.");
+	megahal_learn(ctx, pers, "a lazy dog sleeps in the warm sun all day.");
+	megahal_model_set_publishing(ctx, model, &publish);
+
+	pthread_rwlock_wrlock(&model->lock);
+	pthread_create(&thread, NULL, reply_thread, NULL);
+
+	for (i = 0; (i < 500) && !__atomic_load_n(&replied, __ATOMIC_SEQ_CST); ++i) {
+		usleep(10000);
+	}
+
+	if (!__atomic_load_n(&replied, __ATOMIC_SEQ_CST)) {
+		printf("FAIL: reply waited for the writer\n");
+		failed = 1;
+	}
+
+	pthread_rwlock_unlock(&model->lock);
+	pthread_join(thread, NULL);
+
+	if (failed) {
+		goto done;
+	}
+
+	if (find_word(model->dictionary, zebra) != 0) {
+		printf("FAIL: reply learned into a locked model\n");
+		failed = 1;
+		goto done;
+	}
+
+	megahal_learn(ctx, pers, "the sun sets over the quiet hills.");
+
+	if (find_word(model->dictionary, zebra) == 0) {
+		printf("FAIL: deferred input was never learned\n");
+		failed = 1;
+		goto done;
+	}
+
+	megahal_reply_ex(ctx, pers, "a tall giraffe eats leaves from the tree", output, sizeof(output), &opts, NULL);
+
+	if ((megahal_model_save_mapped(ctx, model, "reply_unblocked.map") != 0) ||
+	    (megahal_model_load_mapped(ctx, "reply_unblocked.map", &mapped) != 0)) {
+		printf("FAIL: couldn't save and load a mapped brain\n");
+		failed = 1;
+		goto done;
+	}
+
+	unlink("reply_unblocked.map");
+
+	if (find_word(mapped->dictionary, giraffe) == 0) {
+		printf("FAIL: deferred input is missing from the mapped save\n");
+		failed = 1;
+		goto done;
+	}
+
+	printf("OK\n");
+
+done:
+	if (mapped != NULL) {
+		megahal_model_free(ctx, mapped);
+	}
+
+	megahal_personality_free(ctx, pers);
+	megahal_model_free(ctx, model);
+	free_words(ctx, ban);
+	free_dictionary(ctx, ban);
+	af_free(ctx, ban);
+	free_words(ctx, aux);
+	free_dictionary(ctx, aux);
+	af_free(ctx, aux);
+	free_swap(ctx, swap);
+	af_free(ctx, ctx);
+
+	return failed;
+}
@@ -0,0 +1,92 @@
+/* In UTF-8 mode a sentence of ideographs is split a character at a time,
+ * learned whole, gives keywords and comes back out as it went in.
+ *
+ *   cc -std=gnu99 -pthread tests/utf8_cjk.c -lm && ./a.out
+ */
+#include "../libmegahal.c"
+
+#define SENTENCE "今天天气很好我们去公园"
+
+int
+main(void)
+{
+	megahal_ctx_t ctx;
+	megahal_personality_t pers;
+	megahal_model_t model;
+	megahal_dict_t ban = NULL;
+	megahal_dict_t aux = NULL;
+	megahal_swaplist_t swap = NULL;
+	struct megahal_dict *words;
+	struct megahal_dict *keys;
+	STRING park = { 3, "园" };
+	char output[1024];
+	int failed = 0;
+
+	megahal_ctx_init(&ctx, NULL);
+	megahal_ctx_set_tokenizer(ctx, MEGAHAL_TOKENIZER_UTF8);
+	megahal_personality_init(ctx, &pers);
+	megahal_model_init(ctx, &model);
+	megahal_personality_set_model(pers, model);
+	megahal_dict_init(ctx, &ban);
+	megahal_dict_init(ctx, &aux);
+	megahal_swaplist_init(ctx, &swap);
+	megahal_personality_set_ban(pers, ban);
+	megahal_personality_set_aux(pers, aux);
+	megahal_personality_set_swap(pers, swap);
+
+	/* Eleven ideographs and the full stop added after the last one. */
+	words = new_dictionary(ctx);
+	make_words(ctx, SENTENCE, strlen(SENTENCE), words);
+
+	if ((words->size != 12) || !same_word(words->entry[10], park) ||
+	    (words->entry[11].length != 1) || (words->entry[11].word[0] != '.')) {
+		printf("FAIL: split into %u words\n", words->size);
+		failed = 1;
+	}
+
+	megahal_learn(ctx, pers, SENTENCE);
+
+	if (find_word(model->dictionary, park) == 0) {
+		printf("FAIL: the last ideograph wasn't learned\n");
+		failed = 1;
+	}
+
+	keys = new_dictionary(ctx);
+	make_keywords(ctx, pers, model->dictionary, words, keys);
+
+	if ((keys->size == 0) || (find_word(keys, park) == 0)) {
+		printf("FAIL: %u keywords, without the last ideograph\n", keys->size);
+		failed = 1;
+	}
+
+	/* The only reply a keyword from the sentence can lead to is the
+	 * whole sentence. */
+	megahal_reply(ctx, pers, "公园", output, sizeof(output));
+
+	if (strcmp(output, SENTENCE ".") != 0) {
+		printf("FAIL: replied \"%s\"\n", output);
+		failed = 1;
+	}
+
+	if (!failed) {
+		printf("OK\n");
+	}
+
+	free_dictionary(ctx, words);
+	af_free(ctx, words);
+	free_words(ctx, keys);
+	free_dictionary(ctx, keys);
+	af_free(ctx, keys);
+	megahal_personality_free(ctx, pers);
+	megahal_model_free(ctx, model);
+	free_words(ctx, ban);
+	free_dictionary(ctx, ban);
+	af_free(ctx, ban);
+	free_words(ctx, aux);
+	free_dictionary(ctx, aux);
+	af_free(ctx, aux);
+	free_swap(ctx, swap);
+	af_free(ctx, ctx);
+
+	return failed;
+}